@@ -0,0 +1,678 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#include "archive.hpp"
+
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+namespace fssync
+{
+
+using namespace phosphor::logging;
+using details::RecordHeader;
+
+/** @brief 'FSAR' */
+static constexpr uint32_t recordMagic = 0x52415346;
+/** @brief Size of the buffered records to be written at once */
+static constexpr size_t flushSize = 1024 * 1024;
+/** @brief The image is never compacted while it's smaller */
+static constexpr off_t minCompactSize = 1024 * 1024;
+
+static uint32_t checksum(const void* data, size_t size, uint32_t crc = 0)
+{
+    return crc32(crc, static_cast<const Bytef*>(data), size);
+}
+
+/**
+ * @brief Fill in the header checksum and add the record to the buffer.
+ */
+static void serialize(std::vector<char>& buffer, RecordHeader& header,
+                      const std::string& path,
+                      const std::vector<char>& stored)
+{
+    header.magic = recordMagic;
+    header.pathSize = path.size();
+    header.storedSize = stored.size();
+    header.headerCrc = 0;
+    header.headerCrc =
+        checksum(path.data(), path.size(), checksum(&header, sizeof(header)));
+
+    auto ptr = reinterpret_cast<const char*>(&header);
+    buffer.insert(buffer.end(), ptr, ptr + sizeof(header));
+    buffer.insert(buffer.end(), path.begin(), path.end());
+    buffer.insert(buffer.end(), stored.begin(), stored.end());
+}
+
+static bool writeAll(int fd, const std::vector<char>& buffer, off_t offset)
+{
+    for (size_t done = 0; done < buffer.size();)
+    {
+        auto rc = pwrite(fd, buffer.data() + done, buffer.size() - done,
+                         offset + done);
+        if (rc <= 0)
+        {
+            return false;
+        }
+        done += rc;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* data, size_t size, off_t offset)
+{
+    auto ptr = static_cast<char*>(data);
+    for (size_t done = 0; done < size;)
+    {
+        auto rc = pread(fd, ptr + done, size - done, offset + done);
+        if (rc <= 0)
+        {
+            return false;
+        }
+        done += rc;
+    }
+    return true;
+}
+
+static bool readFile(const fs::path& path, std::vector<char>& data)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok)
+    {
+        data.resize(st.st_size);
+        ok = readAll(fd, data.data(), data.size(), 0);
+    }
+    close(fd);
+    return ok;
+}
+
+static Archive::Type entryType(mode_t mode)
+{
+    if (S_ISREG(mode))
+    {
+        return Archive::Type::File;
+    }
+    if (S_ISDIR(mode))
+    {
+        return Archive::Type::Directory;
+    }
+    if (S_ISLNK(mode))
+    {
+        return Archive::Type::Symlink;
+    }
+    return Archive::Type::Delete;
+}
+
+Archive::Archive(const fs::path& image, bool readOnly) :
+    image(image), readOnly(readOnly)
+{
+    fd = readOnly ? open(image.c_str(), O_RDONLY | O_CLOEXEC)
+                  : open(image.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        throw std::runtime_error(fmt::format("Failed to open '{}', {}",
+                                             image.c_str(), strerror(errno)));
+    }
+    load();
+}
+
+Archive::~Archive()
+{
+    rollback();
+    close(fd);
+}
+
+void Archive::load()
+{
+    auto end = lseek(fd, 0, SEEK_END);
+    std::map<std::string, Entry> scratch;
+    RecordHeader header;
+    std::string path;
+    off_t offset = 0;
+
+    while (auto size = readRecord(offset, end, header, path))
+    {
+        auto type = static_cast<Type>(header.type);
+        if (type == Type::Commit)
+        {
+            for (auto& [key, entry] : scratch)
+            {
+                if (entry.type == Type::Delete)
+                {
+                    index.erase(key);
+                }
+                else
+                {
+                    index[key] = entry;
+                }
+            }
+            scratch.clear();
+            committedSize = offset + size;
+            generation = header.size;
+        }
+        else
+        {
+            scratch[path] = {type,
+                             header.mode,
+                             header.uid,
+                             header.gid,
+                             header.mtimeSec,
+                             header.mtimeNsec,
+                             header.size,
+                             offset,
+                             size,
+                             header.dataCrc};
+        }
+        offset += size;
+    }
+
+    if (end > committedSize)
+    {
+        log<level::WARNING>("Uncommitted records in the image discarded",
+                            entry("IMAGE=%s", image.c_str()),
+                            entry("SIZE=%lld",
+                                  static_cast<long long>(end - committedSize)));
+    }
+    bufferOffset = committedSize;
+    rollback();
+}
+
+size_t Archive::readRecord(off_t offset, off_t end, RecordHeader& header,
+                           std::string& path) const
+{
+    if (offset + static_cast<off_t>(sizeof(header)) > end ||
+        !readAll(fd, &header, sizeof(header), offset) ||
+        header.magic != recordMagic || header.pathSize > PATH_MAX)
+    {
+        return 0;
+    }
+
+    auto size = sizeof(header) + header.pathSize + header.storedSize;
+    if (header.storedSize > static_cast<uint64_t>(end) ||
+        offset + static_cast<off_t>(size) > end)
+    {
+        return 0;
+    }
+
+    path.resize(header.pathSize);
+    if (!readAll(fd, path.data(), path.size(), offset + sizeof(header)))
+    {
+        return 0;
+    }
+
+    auto crc = header.headerCrc;
+    header.headerCrc = 0;
+    if (crc != checksum(path.data(), path.size(),
+                        checksum(&header, sizeof(header))))
+    {
+        return 0;
+    }
+    return size;
+}
+
+bool Archive::readData(const std::string& path, const Entry& entry,
+                       std::vector<char>& data) const
+{
+    auto offset = sizeof(RecordHeader) + path.size();
+    std::vector<char> stored(entry.recordSize - offset);
+    data.resize(entry.size);
+    if (!readAll(fd, stored.data(), stored.size(), entry.offset + offset))
+    {
+        return false;
+    }
+
+    uLongf size = data.size();
+    if (!stored.empty() &&
+        uncompress(reinterpret_cast<Bytef*>(data.data()), &size,
+                   reinterpret_cast<const Bytef*>(stored.data()),
+                   stored.size()) != Z_OK)
+    {
+        return false;
+    }
+    return size == data.size() &&
+           checksum(data.data(), data.size()) == entry.dataCrc;
+}
+
+const Archive::Entry* Archive::find(const std::string& path) const
+{
+    auto it = pending.find(path);
+    if (it == pending.end())
+    {
+        it = index.find(path);
+        if (it == index.end())
+        {
+            return nullptr;
+        }
+    }
+    return it->second.type == Type::Delete ? nullptr : &it->second;
+}
+
+std::vector<std::string> Archive::children(const std::string& path) const
+{
+    auto prefix = path.empty() ? path : path + '/';
+    std::vector<std::string> paths;
+    for (const auto* map : {&index, &pending})
+    {
+        for (auto it = map->lower_bound(prefix);
+             it != map->end() && it->first.rfind(prefix, 0) == 0; ++it)
+        {
+            // Entries updated since the last commit are listed once.
+            if (find(it->first) && (map == &index || !index.count(it->first)))
+            {
+                paths.emplace_back(it->first);
+            }
+        }
+    }
+    return paths;
+}
+
+bool Archive::append(Type type, const std::string& path,
+                     const struct stat& st, const std::vector<char>& data)
+{
+    std::vector<char> stored;
+    if (!data.empty())
+    {
+        uLongf size = compressBound(data.size());
+        stored.resize(size);
+        if (compress2(reinterpret_cast<Bytef*>(stored.data()), &size,
+                      reinterpret_cast<const Bytef*>(data.data()),
+                      data.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+            log<level::ERR>("Failed to compress entry",
+                            entry("PATH=%s", path.c_str()));
+            return false;
+        }
+        stored.resize(size);
+    }
+
+    RecordHeader header{};
+    header.type = static_cast<uint8_t>(type);
+    header.mode = st.st_mode;
+    header.uid = st.st_uid;
+    header.gid = st.st_gid;
+    header.mtimeSec = st.st_mtim.tv_sec;
+    header.mtimeNsec = st.st_mtim.tv_nsec;
+    header.size = data.size();
+    header.dataCrc = checksum(data.data(), data.size());
+
+    off_t offset = bufferOffset + buffer.size();
+    serialize(buffer, header, path, stored);
+    pending[path] = {type,
+                     header.mode,
+                     header.uid,
+                     header.gid,
+                     header.mtimeSec,
+                     header.mtimeNsec,
+                     header.size,
+                     offset,
+                     static_cast<size_t>(bufferOffset + buffer.size() - offset),
+                     header.dataCrc};
+
+    return buffer.size() < flushSize || flush();
+}
+
+bool Archive::flush()
+{
+    if (!writeAll(fd, buffer, bufferOffset))
+    {
+        log<level::ERR>("Failed to write image",
+                        entry("IMAGE=%s", image.c_str()),
+                        entry("ERROR=%s", strerror(errno)));
+        return false;
+    }
+    bufferOffset += buffer.size();
+    buffer.clear();
+    return true;
+}
+
+void Archive::remove(const std::string& path)
+{
+    struct stat st
+    {};
+    auto paths = children(path);
+    if (find(path))
+    {
+        paths.emplace_back(path);
+    }
+    for (const auto& item : paths)
+    {
+        append(Type::Delete, item, st, {});
+    }
+}
+
+bool Archive::update(const fs::path& root, const fs::path& entryPath,
+                     bool quick)
+{
+    bool ok = true;
+    std::vector<fs::path> work{entryPath};
+    while (!work.empty())
+    {
+        auto relPath = std::move(work.back());
+        work.pop_back();
+
+        const auto& path = relPath.native();
+        auto srcPath = root / relPath;
+        struct stat st;
+        if (lstat(srcPath.c_str(), &st) == -1)
+        {
+            if (errno == ENOENT)
+            {
+                remove(path);
+                continue;
+            }
+            log<level::ERR>("lstat failed", entry("PATH=%s", srcPath.c_str()),
+                            entry("ERROR=%s", strerror(errno)));
+            ok = false;
+            continue;
+        }
+
+        auto type = entryType(st.st_mode);
+        if (type == Type::Delete)
+        {
+            // Special files are not tracked.
+            continue;
+        }
+
+        auto old = find(path);
+        bool same = old && old->mode == st.st_mode && old->uid == st.st_uid &&
+                    old->gid == st.st_gid &&
+                    (type == Type::Directory ||
+                     (old->size == static_cast<uint64_t>(st.st_size) &&
+                      old->mtimeSec == st.st_mtim.tv_sec &&
+                      old->mtimeNsec == st.st_mtim.tv_nsec));
+
+        std::vector<char> data;
+        if (type == Type::Directory)
+        {
+            for (const auto& child : children(path))
+            {
+                if (!fs::exists(fs::symlink_status(root / child)))
+                {
+                    remove(child);
+                }
+            }
+
+            std::error_code ec;
+            for (auto it = fs::directory_iterator(srcPath, ec);
+                 !ec && it != fs::directory_iterator(); it.increment(ec))
+            {
+                work.emplace_back(relPath / it->path().filename());
+            }
+            if (ec)
+            {
+                log<level::ERR>("Failed to read directory",
+                                entry("PATH=%s", srcPath.c_str()),
+                                entry("ERROR=%s", ec.message().c_str()));
+                ok = false;
+            }
+
+            // The source directory itself isn't an entry of the image.
+            if (same || path.empty())
+            {
+                continue;
+            }
+        }
+        else if (same && quick)
+        {
+            continue;
+        }
+        else if (type == Type::Symlink)
+        {
+            std::error_code ec;
+            auto target = fs::read_symlink(srcPath, ec).native();
+            if (ec)
+            {
+                log<level::ERR>("Failed to read symlink",
+                                entry("PATH=%s", srcPath.c_str()),
+                                entry("ERROR=%s", ec.message().c_str()));
+                ok = false;
+                continue;
+            }
+            data.assign(target.begin(), target.end());
+        }
+        else if (!readFile(srcPath, data))
+        {
+            log<level::ERR>("Failed to read file",
+                            entry("PATH=%s", srcPath.c_str()),
+                            entry("ERROR=%s", strerror(errno)));
+            ok = false;
+            continue;
+        }
+
+        if (same && old->dataCrc == checksum(data.data(), data.size()))
+        {
+            continue;
+        }
+        ok = append(type, path, st, data) && ok;
+    }
+    return ok;
+}
+
+bool Archive::commit()
+{
+    if (pending.empty())
+    {
+        return true;
+    }
+
+    // The commit record must not reach the flash before the data records.
+    if (!flush() || fdatasync(fd) == -1)
+    {
+        rollback();
+        return false;
+    }
+
+    RecordHeader header{};
+    header.type = static_cast<uint8_t>(Type::Commit);
+    header.size = generation + 1;
+    serialize(buffer, header, {}, {});
+    if (!flush() || fdatasync(fd) == -1)
+    {
+        rollback();
+        return false;
+    }
+
+    for (auto& [path, entry] : pending)
+    {
+        if (entry.type == Type::Delete)
+        {
+            index.erase(path);
+        }
+        else
+        {
+            index[path] = entry;
+        }
+    }
+    pending.clear();
+    committedSize = bufferOffset;
+    ++generation;
+    return true;
+}
+
+void Archive::rollback()
+{
+    pending.clear();
+    buffer.clear();
+    bufferOffset = committedSize;
+    if (!readOnly && ftruncate(fd, committedSize) == -1)
+    {
+        log<level::ERR>("Failed to truncate image",
+                        entry("IMAGE=%s", image.c_str()),
+                        entry("ERROR=%s", strerror(errno)));
+    }
+}
+
+bool Archive::compact()
+{
+    size_t liveSize = 0;
+    for (const auto& [path, entry] : index)
+    {
+        liveSize += entry.recordSize;
+    }
+    if (committedSize < minCompactSize ||
+        liveSize * 2 > static_cast<size_t>(committedSize))
+    {
+        return true;
+    }
+
+    log<level::INFO>("Compact image", entry("IMAGE=%s", image.c_str()),
+                     entry("SIZE=%lld", static_cast<long long>(committedSize)),
+                     entry("LIVE=%zu", liveSize));
+
+    auto tmp = image;
+    tmp += ".tmp";
+    int out = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out == -1)
+    {
+        log<level::ERR>("Failed to create image",
+                        entry("IMAGE=%s", tmp.c_str()),
+                        entry("ERROR=%s", strerror(errno)));
+        return false;
+    }
+
+    // Records are copied as is, their data is not recompressed.
+    auto compacted = index;
+    std::vector<char> chunk;
+    off_t offset = 0;
+    bool ok = true;
+    for (auto& [path, entry] : compacted)
+    {
+        auto size = chunk.size();
+        chunk.resize(size + entry.recordSize);
+        ok = readAll(fd, chunk.data() + size, entry.recordSize, entry.offset);
+        if (!ok)
+        {
+            break;
+        }
+        entry.offset = offset + size;
+        if (chunk.size() >= flushSize)
+        {
+            ok = writeAll(out, chunk, offset);
+            offset += chunk.size();
+            chunk.clear();
+        }
+    }
+
+    RecordHeader header{};
+    header.type = static_cast<uint8_t>(Type::Commit);
+    header.size = generation + 1;
+    serialize(chunk, header, {}, {});
+    ok = ok && writeAll(out, chunk, offset) && fsync(out) == 0 &&
+         rename(tmp.c_str(), image.c_str()) == 0;
+    if (!ok)
+    {
+        log<level::ERR>("Failed to compact image",
+                        entry("IMAGE=%s", image.c_str()),
+                        entry("ERROR=%s", strerror(errno)));
+        close(out);
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    int dir = open(image.parent_path().c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir != -1)
+    {
+        fsync(dir);
+        close(dir);
+    }
+
+    close(fd);
+    fd = out;
+    index = std::move(compacted);
+    committedSize = bufferOffset = offset + chunk.size();
+    ++generation;
+    return true;
+}
+
+bool Archive::restore(const fs::path& root) const
+{
+    bool ok = true;
+    std::vector<char> data;
+    // Parent directories precede their entries in the sorted index.
+    for (const auto& [path, item] : index)
+    {
+        auto dst = root / path;
+        std::error_code ec;
+
+        if (item.type != Type::Directory &&
+            !readData(path, item, data))
+        {
+            log<level::ERR>("Broken image entry",
+                            entry("PATH=%s", path.c_str()));
+            ok = false;
+            continue;
+        }
+
+        fs::create_directories(
+            item.type == Type::Directory ? dst : dst.parent_path(), ec);
+        if (item.type == Type::Symlink && !ec)
+        {
+            fs::remove(dst, ec);
+            if (!ec)
+            {
+                fs::create_symlink(std::string(data.begin(), data.end()), dst,
+                                   ec);
+            }
+        }
+        else if (item.type == Type::File && !ec)
+        {
+            auto tmp = dst;
+            tmp += ".fssync~";
+            const struct timespec times[] = {
+                {item.mtimeSec, item.mtimeNsec},
+                {item.mtimeSec, item.mtimeNsec},
+            };
+            int out = open(tmp.c_str(),
+                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            bool written = out != -1 && writeAll(out, data, 0) &&
+                           fchmod(out, item.mode & 07777) == 0 &&
+                           futimens(out, times) == 0 && fsync(out) == 0;
+            if (out != -1)
+            {
+                written = close(out) == 0 && written;
+            }
+            if (!written || rename(tmp.c_str(), dst.c_str()) == -1)
+            {
+                ec.assign(errno, std::generic_category());
+                unlink(tmp.c_str());
+            }
+        }
+        else if (item.type == Type::Directory && !ec &&
+                 chmod(dst.c_str(), item.mode & 07777) == -1)
+        {
+            ec.assign(errno, std::generic_category());
+        }
+
+        if (!ec && lchown(dst.c_str(), item.uid, item.gid) == -1)
+        {
+            ec.assign(errno, std::generic_category());
+        }
+
+        if (ec)
+        {
+            log<level::ERR>("Failed to restore entry",
+                            entry("PATH=%s", dst.c_str()),
+                            entry("ERROR=%s", ec.message().c_str()));
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+} // namespace fssync
@@ -0,0 +1,223 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#pragma once
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace fssync
+{
+
+namespace details
+{
+/**
+ * @brief Header of the archive record.
+ *
+ * Every record is followed by the entry path and the zlib compressed data:
+ * the file content or the symlink target.
+ */
+struct RecordHeader
+{
+    uint32_t magic;
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pathSize;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    /** @brief Size of the uncompressed data, generation for commit record */
+    uint64_t size;
+    /** @brief Size of the compressed data */
+    uint64_t storedSize;
+    /** @brief CRC32 of the uncompressed data */
+    uint32_t dataCrc;
+    /** @brief CRC32 of the header and the path */
+    uint32_t headerCrc;
+};
+} // namespace details
+
+/**
+ * @brief Append-only compressed image of the tracked files.
+ *
+ * Each sync appends records for the changed entries only, followed by the
+ * commit record. The entries not changed since the previous generation are
+ * referenced by their old records, so the image is updated by a few
+ * sequential writes. Records after the last commit are discarded on load,
+ * which makes interrupted syncs harmless. The image is rewritten with live
+ * records only once the superseded ones take most of its size.
+ */
+class Archive
+{
+  public:
+    enum class Type : uint8_t
+    {
+        File = 1,
+        Directory,
+        Symlink,
+        Delete,
+        Commit,
+    };
+
+    Archive() = delete;
+    Archive(const Archive&) = delete;
+    Archive& operator=(const Archive&) = delete;
+    Archive(Archive&&) = delete;
+    Archive& operator=(Archive&&) = delete;
+
+    /**
+     * @brief ctor - open the image and load the index of the last committed
+     * generation
+     *
+     * @param image    - path to the image file, created if not exists
+     * @param readOnly - open the image for restoring only
+     *
+     * @throw std::runtime_error if the image can't be opened.
+     */
+    explicit Archive(const fs::path& image, bool readOnly = false);
+
+    /**
+     * @brief dtor - close the image, uncommitted records are discarded.
+     */
+    ~Archive();
+
+    /**
+     * @brief Record the state of the entry if it changed.
+     *
+     * Missing entries are removed from the image, directories are processed
+     * recursively. The content of the entry is read and recorded unless it
+     * matches the last generation by type, owner, permissions, size,
+     * modification time and CRC32 of the data. The quick check skips reading
+     * of the files with the same attributes, it is only suitable when the
+     * entry is not known to be changed, since a rewrite within the mtime
+     * granularity keeps the attributes.
+     *
+     * @param root      - source directory
+     * @param entryPath - path relative to the source directory
+     * @param quick     - compare the attributes only
+     *
+     * @return false on error.
+     */
+    bool update(const fs::path& root, const fs::path& entryPath,
+                bool quick = false);
+
+    /**
+     * @brief Write the appended records and the commit record to the image.
+     *
+     * @return false on error.
+     */
+    bool commit();
+
+    /**
+     * @brief Drop the records appended since the last commit.
+     */
+    void rollback();
+
+    /**
+     * @brief Rewrite the image if superseded records take most of it.
+     *
+     * @return false on error.
+     */
+    bool compact();
+
+    /**
+     * @brief Expand the last committed generation into the directory.
+     *
+     * @return false if any entry failed.
+     */
+    bool restore(const fs::path& root) const;
+
+  private:
+    struct Entry
+    {
+        Type type;
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+        int64_t mtimeSec;
+        int64_t mtimeNsec;
+        uint64_t size;
+        /** @brief Offset of the record in the image */
+        off_t offset;
+        /** @brief Size of the whole record */
+        size_t recordSize;
+        /** @brief CRC32 of the uncompressed data */
+        uint32_t dataCrc;
+    };
+
+    /**
+     * @brief Read the image and build the index, truncate uncommitted tail.
+     */
+    void load();
+
+    /**
+     * @brief Read the record at the offset.
+     *
+     * @return size of the record or 0 if it's broken.
+     */
+    size_t readRecord(off_t offset, off_t end, details::RecordHeader& header,
+                      std::string& path) const;
+
+    /**
+     * @brief Read and uncompress data of the entry.
+     */
+    bool readData(const std::string& path, const Entry& entry,
+                  std::vector<char>& data) const;
+
+    /**
+     * @brief Get the entry from the current generation.
+     *
+     * @return nullptr if the entry doesn't exist or is removed.
+     */
+    const Entry* find(const std::string& path) const;
+
+    /**
+     * @brief Get paths of the existing entries under the directory.
+     */
+    std::vector<std::string> children(const std::string& path) const;
+
+    /**
+     * @brief Queue the record to be written by the next commit.
+     */
+    bool append(Type type, const std::string& path, const struct stat& st,
+                const std::vector<char>& data);
+
+    /**
+     * @brief Write the queued records to the image.
+     */
+    bool flush();
+
+    /**
+     * @brief Record removal of the entry and everything under it.
+     */
+    void remove(const std::string& path);
+
+    fs::path image;
+    bool readOnly;
+    int fd = -1;
+    /** @brief Size of the committed part of the image */
+    off_t committedSize = 0;
+    /** @brief Number of the last committed generation */
+    uint64_t generation = 0;
+    /** @brief Live entries of the last generation sorted by path */
+    std::map<std::string, Entry> index;
+    /** @brief Index of the entries updated since the last commit */
+    std::map<std::string, Entry> pending;
+    /** @brief Records queued for writing */
+    std::vector<char> buffer;
+    /** @brief Offset in the image the buffer will be written to */
+    off_t bufferOffset = 0;
+};
+
+} // namespace fssync
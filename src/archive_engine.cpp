@@ -0,0 +1,109 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#include "archive_engine.hpp"
+
+namespace fssync
+{
+
+ArchiveEngine::ArchiveEngine(sdeventplus::Event& event, const fs::path& src,
+                             const fs::path& image,
+                             const std::vector<fs::path>& roots) :
+    Engine(event, src, image),
+    archive(image), reconcile(roots.begin(), roots.end()),
+    thread(&ArchiveEngine::worker, this)
+{}
+
+ArchiveEngine::~ArchiveEngine()
+{
+    cancelled = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    thread.join();
+}
+
+void ArchiveEngine::cancel()
+{
+    cancelled = true;
+}
+
+void ArchiveEngine::submit(std::vector<fs::path>&& batch)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue = std::move(batch);
+        queued = true;
+        cancelled = false;
+    }
+    cv.notify_all();
+}
+
+void ArchiveEngine::complete()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!queued)
+    {
+        bool result = success;
+        lock.unlock();
+        finish(result);
+    }
+}
+
+void ArchiveEngine::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        cv.wait(lock, [this] { return stop || queued; });
+        if (stop)
+        {
+            break;
+        }
+
+        auto batch = std::move(queue);
+        lock.unlock();
+
+        bool ok = true;
+        for (const auto& path : batch)
+        {
+            if (cancelled)
+            {
+                break;
+            }
+            // The paths from the events are known to be changed, so their
+            // content is always checked.
+            ok = archive.update(source, path, reconcile.count(path) != 0) &&
+                 ok;
+        }
+
+        // An interrupted batch leaves the image at the previous generation.
+        if (cancelled)
+        {
+            archive.rollback();
+            ok = false;
+        }
+        else
+        {
+            ok = archive.commit() && ok;
+            archive.compact();
+            if (ok)
+            {
+                for (const auto& path : batch)
+                {
+                    reconcile.erase(path);
+                }
+            }
+        }
+
+        lock.lock();
+        success = ok;
+        queued = false;
+        notify();
+    }
+}
+
+} // namespace fssync
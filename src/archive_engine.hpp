@@ -0,0 +1,67 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#pragma once
+
+#include "archive.hpp"
+#include "engine.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace fssync
+{
+
+/**
+ * @brief Engine recording the changed paths into the archive image.
+ *
+ * Every batch becomes a new generation of the image. Reading and compressing
+ * of the files is done in a worker thread.
+ */
+class ArchiveEngine : public Engine
+{
+  public:
+    /**
+     * @brief ctor - open the image and start worker thread
+     *
+     * @param event - sd-event object
+     * @param src   - source directory
+     * @param image - path to the image file
+     * @param roots - paths to be reconciled with the image by the first
+     *                batch, their files are compared by attributes only
+     */
+    ArchiveEngine(sdeventplus::Event& event, const fs::path& src,
+                  const fs::path& image, const std::vector<fs::path>& roots);
+
+    /**
+     * @brief dtor - stop worker thread, the unfinished batch is discarded
+     */
+    ~ArchiveEngine() override;
+
+    void cancel() override;
+
+  protected:
+    void submit(std::vector<fs::path>&& batch) override;
+    void complete() override;
+
+  private:
+    void worker();
+
+    Archive archive;
+    /** @brief Roots not reconciled yet, accessed by the worker only */
+    std::set<fs::path> reconcile;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<fs::path> queue;
+    bool queued = false;
+    bool success = false;
+    bool stop = false;
+    std::atomic<bool> cancelled = false;
+    std::thread thread;
+};
+
+} // namespace fssync
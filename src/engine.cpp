@@ -0,0 +1,326 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#include "config.h"
+
+#include "engine.hpp"
+
+#include "logger.hpp"
+#include "thread_engine.hpp"
+#ifdef HAVE_IO_URING
+#include "uring_engine.hpp"
+#endif
+
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <array>
+#include <stdexcept>
+#include <string_view>
+
+namespace fssync
+{
+
+using namespace phosphor::logging;
+
+namespace details
+{
+
+fs::path tempPath(const fs::path& path)
+{
+    return path.parent_path() /
+           fmt::format(".{}.fssync~", path.filename().c_str());
+}
+
+bool isTempName(const fs::path& name)
+{
+    constexpr std::string_view suffix = ".fssync~";
+    const auto& str = name.native();
+    return str.size() > suffix.size() + 1 && str.front() == '.' &&
+           str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool syncDirectories(const std::set<fs::path>& dirs)
+{
+    bool ok = true;
+    for (const auto& dir : dirs)
+    {
+        int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno != ENOENT)
+            {
+                log<level::ERR>("open failed", entry("PATH=%s", dir.c_str()),
+                                entry("ERROR=%s", strerror(errno)));
+                ok = false;
+            }
+            continue;
+        }
+        if (fsync(fd) == -1)
+        {
+            log<level::ERR>("fsync failed", entry("PATH=%s", dir.c_str()),
+                            entry("ERROR=%s", strerror(errno)));
+            ok = false;
+        }
+        close(fd);
+    }
+    return ok;
+}
+
+void createDirectories(const fs::path& dir, std::set<fs::path>& touched,
+                       std::error_code& ec)
+{
+    auto existing = dir;
+    while (!existing.empty() && !fs::exists(fs::symlink_status(existing)))
+    {
+        existing = existing.parent_path();
+    }
+    if (existing == dir)
+    {
+        ec.clear();
+        return;
+    }
+
+    // The new directories are entries of their parents, so both have to be
+    // flushed to make the files created inside durable.
+    fs::create_directories(dir, ec);
+    if (!ec)
+    {
+        for (auto path = dir; path != existing; path = path.parent_path())
+        {
+            touched.emplace(path);
+            touched.emplace(path.parent_path());
+        }
+    }
+}
+
+bool copyAttributes(int fd, const struct statx& stx)
+{
+    const struct timespec times[] = {
+        {stx.stx_atime.tv_sec, stx.stx_atime.tv_nsec},
+        {stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec},
+    };
+
+    return fchown(fd, stx.stx_uid, stx.stx_gid) == 0 &&
+           fchmod(fd, stx.stx_mode & 07777) == 0 && futimens(fd, times) == 0;
+}
+
+static bool copyFile(const fs::path& src, const fs::path& dst,
+                     const struct statx& stx)
+{
+    auto tmp = tempPath(dst);
+    int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+    {
+        return false;
+    }
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out == -1)
+    {
+        close(in);
+        return false;
+    }
+
+    bool ok = true;
+    std::array<char, 64 * 1024> buffer;
+    ssize_t bytes;
+    while (ok && (bytes = read(in, buffer.data(), buffer.size())) != 0)
+    {
+        ok = bytes > 0;
+        for (ssize_t offset = 0; ok && offset < bytes;)
+        {
+            auto written = write(out, buffer.data() + offset, bytes - offset);
+            ok = written > 0;
+            offset += written;
+        }
+    }
+
+    ok = ok && copyAttributes(out, stx) && fsync(out) == 0;
+    close(in);
+    ok = close(out) == 0 && ok;
+    ok = ok && rename(tmp.c_str(), dst.c_str()) == 0;
+    if (!ok)
+    {
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+bool copyEntry(const fs::path& src, const fs::path& dst,
+               std::vector<fs::path>& children, std::set<fs::path>& touched)
+{
+    touched.emplace(dst.parent_path());
+
+    std::error_code ec;
+    struct statx stx;
+    if (statx(AT_FDCWD, src.c_str(), AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS,
+              &stx) == -1)
+    {
+        if (errno != ENOENT)
+        {
+            log<level::ERR>("statx failed", entry("PATH=%s", src.c_str()),
+                            entry("ERROR=%s", strerror(errno)));
+            return false;
+        }
+        fs::remove_all(dst, ec);
+    }
+    else if (S_ISDIR(stx.stx_mode))
+    {
+        createDirectories(dst, touched, ec);
+        if (!ec && (lchown(dst.c_str(), stx.stx_uid, stx.stx_gid) == -1 ||
+                    chmod(dst.c_str(), stx.stx_mode & 07777) == -1))
+        {
+            ec.assign(errno, std::generic_category());
+        }
+        // Remove entries which no longer exist in the source directory.
+        // Temporary files of the entries being copied are kept.
+        for (auto it = fs::directory_iterator(dst, ec);
+             !ec && it != fs::directory_iterator(); it.increment(ec))
+        {
+            auto name = it->path().filename();
+            if (!isTempName(name) &&
+                !fs::exists(fs::symlink_status(src / name)))
+            {
+                fs::remove_all(it->path(), ec);
+                touched.emplace(dst);
+            }
+        }
+        for (auto it = fs::directory_iterator(src, ec);
+             !ec && it != fs::directory_iterator(); it.increment(ec))
+        {
+            children.emplace_back(it->path().filename());
+        }
+    }
+    else if (S_ISLNK(stx.stx_mode))
+    {
+        auto target = fs::read_symlink(src, ec);
+        if (!ec)
+        {
+            createDirectories(dst.parent_path(), touched, ec);
+        }
+        if (!ec)
+        {
+            fs::remove(dst, ec);
+        }
+        if (!ec)
+        {
+            fs::create_symlink(target, dst, ec);
+        }
+        if (!ec && lchown(dst.c_str(), stx.stx_uid, stx.stx_gid) == -1)
+        {
+            ec.assign(errno, std::generic_category());
+        }
+    }
+    else if (S_ISREG(stx.stx_mode))
+    {
+        createDirectories(dst.parent_path(), touched, ec);
+        if (!ec && !copyFile(src, dst, stx))
+        {
+            ec.assign(errno, std::generic_category());
+        }
+    }
+    else
+    {
+        logger::log<level::DEBUG>("Special file skipped: {}", src.c_str());
+    }
+
+    if (ec)
+    {
+        log<level::ERR>("Failed to copy entry", entry("PATH=%s", src.c_str()),
+                        entry("ERROR=%s", ec.message().c_str()));
+        return false;
+    }
+    return true;
+}
+
+} // namespace details
+
+static int createEventFd()
+{
+    auto fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == fd)
+    {
+        throw std::runtime_error(
+            fmt::format("eventfd() failed, {}", strerror(errno)));
+    }
+    return fd;
+}
+
+Engine::Engine(sdeventplus::Event& event, const fs::path& src,
+               const fs::path& dst) :
+    source(src),
+    destination(dst), eventFd(createEventFd()),
+    notifier(event, eventFd, EPOLLIN,
+             std::bind(&Engine::handleNotify, this, std::placeholders::_1,
+                       std::placeholders::_2, std::placeholders::_3))
+{}
+
+Engine::~Engine()
+{
+    if (-1 != eventFd)
+    {
+        close(eventFd);
+    }
+}
+
+std::unique_ptr<Engine> Engine::create(sdeventplus::Event& event,
+                                       const fs::path& src,
+                                       const fs::path& dst, size_t depth)
+{
+#ifdef HAVE_IO_URING
+    try
+    {
+        return std::make_unique<UringEngine>(event, src, dst, depth);
+    }
+    catch (const std::exception& e)
+    {
+        log<level::INFO>("io_uring is not available, use thread pool",
+                         entry("ERROR=%s", e.what()));
+    }
+#endif
+    return std::make_unique<ThreadEngine>(event, src, dst, depth);
+}
+
+void Engine::start(std::vector<fs::path>&& batch, Callback&& callback)
+{
+    this->callback = std::move(callback);
+    submit(std::move(batch));
+}
+
+void Engine::finish(bool success)
+{
+    auto done = std::move(callback);
+    callback = nullptr;
+    if (done)
+    {
+        done(success);
+    }
+}
+
+void Engine::notify()
+{
+    uint64_t value = 1;
+    if (write(notifyFd(), &value, sizeof(value)) == -1)
+    {
+        log<level::ERR>("eventfd write failed",
+                        entry("ERROR=%s", strerror(errno)));
+    }
+}
+
+void Engine::handleNotify(sdeventplus::source::IO&, int fd, uint32_t)
+{
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+    {
+        log<level::ERR>("eventfd read failed",
+                        entry("ERROR=%s", strerror(errno)));
+    }
+    complete();
+}
+
+} // namespace fssync
@@ -0,0 +1,183 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#pragma once
+
+#include <sys/stat.h>
+
+#include <sdeventplus/event.hpp>
+#include <sdeventplus/source/io.hpp>
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <set>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace fssync
+{
+
+namespace details
+{
+/**
+ * @brief Get path of the temporary file used to replace the entry atomically.
+ */
+fs::path tempPath(const fs::path& path);
+
+/**
+ * @brief Check whether the file name is of the temporary file.
+ */
+bool isTempName(const fs::path& name);
+
+/**
+ * @brief Flush the directories to make renames and removals durable.
+ *
+ * @return false on error, missing directories are not an error.
+ */
+bool syncDirectories(const std::set<fs::path>& dirs);
+
+/**
+ * @brief Create the directory and its missing ancestors.
+ *
+ * @param dir     - directory to create
+ * @param touched - the created directories and their parents are added
+ * @param ec      - error code
+ */
+void createDirectories(const fs::path& dir, std::set<fs::path>& touched,
+                       std::error_code& ec);
+
+/**
+ * @brief Apply owner, permissions and timestamps of the source entry to the
+ * opened file.
+ */
+bool copyAttributes(int fd, const struct statx& stx);
+
+/**
+ * @brief Transfer the filesystem entry synchronously.
+ *
+ * Regular files are written to a temporary file which then replaces the
+ * destination. The destination is removed if the source does not exist.
+ * Directories are not copied recursively, the caller should transfer the
+ * returned entries as well.
+ *
+ * @param src      - source entry
+ * @param dst      - destination entry
+ * @param children - names of the source directory entries
+ * @param touched  - destination directories modified by the call
+ */
+bool copyEntry(const fs::path& src, const fs::path& dst,
+               std::vector<fs::path>& children, std::set<fs::path>& touched);
+} // namespace details
+
+/**
+ * @brief In-process copy engine transferring a batch of changed paths from
+ * the source directory to the destination one.
+ *
+ * The work is done asynchronously, completion is reported through an
+ * eventfd hooked with sd-event, so the event loop is never blocked by I/O.
+ */
+class Engine
+{
+  public:
+    using Callback = std::function<void(bool)>;
+
+    static constexpr size_t defaultDepth = 4;
+
+    Engine() = delete;
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+    Engine(Engine&&) = delete;
+    Engine& operator=(Engine&&) = delete;
+
+    /**
+     * @brief dtor - close eventfd
+     */
+    virtual ~Engine();
+
+    /**
+     * @brief Create io_uring based engine if it is supported by the kernel,
+     * thread pool based otherwise.
+     *
+     * @param event - sd-event object
+     * @param src   - source directory
+     * @param dst   - destination directory
+     * @param depth - max number of files processed simultaneously
+     */
+    static std::unique_ptr<Engine> create(sdeventplus::Event& event,
+                                          const fs::path& src,
+                                          const fs::path& dst,
+                                          size_t depth = defaultDepth);
+
+    /**
+     * @brief Start transferring the batch.
+     *
+     * @param batch    - paths relative to the source directory
+     * @param callback - called with the result once the whole batch is done
+     */
+    void start(std::vector<fs::path>&& batch, Callback&& callback);
+
+    /**
+     * @brief Check whether the batch is being transferred.
+     */
+    inline bool isRunning() const
+    {
+        return static_cast<bool>(callback);
+    }
+
+    /**
+     * @brief Drop the files not started yet, the batch fails.
+     */
+    virtual void cancel() = 0;
+
+  protected:
+    /**
+     * @brief ctor - create eventfd and hook it with sd-event
+     */
+    Engine(sdeventplus::Event& event, const fs::path& src,
+           const fs::path& dst);
+
+    /**
+     * @brief Start processing of the batch by the backend.
+     */
+    virtual void submit(std::vector<fs::path>&& batch) = 0;
+
+    /**
+     * @brief Handle the eventfd notification in the event loop.
+     */
+    virtual void complete() = 0;
+
+    /**
+     * @brief Report the batch result.
+     */
+    void finish(bool success);
+
+    /**
+     * @brief Wake up the event loop, may be called from any thread.
+     */
+    void notify();
+
+    /**
+     * @brief Get eventfd, may be called from any thread
+     */
+    inline int notifyFd() const
+    {
+        return eventFd;
+    }
+
+    fs::path source;
+    fs::path destination;
+
+  private:
+    void handleNotify(sdeventplus::source::IO& source, int fd,
+                      uint32_t revent);
+
+    /** @brief Kept apart from the source, sd-event isn't thread-safe */
+    int eventFd;
+    sdeventplus::source::IO notifier;
+    Callback callback;
+};
+
+} // namespace fssync
@@ -0,0 +1,63 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#pragma once
+
+#include <fmt/format.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <atomic>
+
+namespace logger
+{
+
+using Level = phosphor::logging::level;
+
+namespace details
+{
+inline std::atomic<Level> currentLevel{Level::INFO};
+} // namespace details
+
+/**
+ * @brief Set the most verbose level of messages sent to the journal.
+ */
+inline void setLevel(Level level)
+{
+    details::currentLevel.store(level, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Get the most verbose level of messages sent to the journal.
+ */
+inline Level getLevel()
+{
+    return details::currentLevel.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Check whether messages of the specified level are sent.
+ */
+inline bool isEnabled(Level level)
+{
+    return level <= getLevel();
+}
+
+/**
+ * @brief Format and send the message if its level is enabled.
+ *
+ * Formatting is skipped entirely for the disabled levels, so the messages
+ * on the per-event path cost nothing unless debug output is requested.
+ */
+template <Level L, typename... Args>
+inline void log(fmt::format_string<Args...> format, Args&&... args)
+{
+    if (isEnabled(L))
+    {
+        phosphor::logging::log<L>(
+            fmt::format(format, std::forward<Args>(args)...).c_str());
+    }
+}
+
+} // namespace logger
@@ -5,6 +5,8 @@
 
 #include "config.h"
 
+#include "archive.hpp"
+#include "logger.hpp"
 #include "sync.hpp"
 #include "watch.hpp"
 #include "whitelist.hpp"
@@ -18,25 +20,35 @@
 #include <chrono>
 #include <csignal>
 
-static void signalHandler(sdeventplus::source::Signal& source,
-                          const struct signalfd_siginfo*)
-{
-    fmt::print("\rSignal {} recieved, terminating...\n", source.get_signal());
-    source.get_event().exit(EXIT_SUCCESS);
-}
-
 static void printUsage(const char* app)
 {
     fmt::print(
-        "\nUsage: {} [-h] [-d SECONDS] [-w FILE] <source-dir> <dest-dir>\n",
-        app);
+        "\nUsage: {} [-h] [-n|-a] [-v] [-d SECONDS] [-t SECONDS] [-T FILE] "
+        "[-w FILE] <source-dir> <dest-dir>\n"
+        "       {} -r <image> <dest-dir>\n",
+        app, app);
     fmt::print(R"(Required arguments:
   source-dir            Path to the source directory.
   dest-dir              Path to the destination directory.
 
 Optional arguments:
   -h, --help            show this help message and exit.
+  -n, --native          transfer changed files by the in-process copy
+                        engine (io_uring or thread pool) instead of rsync.
+                        rsync is still used for the initial sync.
+  -a, --archive         dest-dir is a path to the compressed image file
+                        which is updated by appending the changed files.
+  -r, --restore         expand the image into the destination directory
+                        and exit.
+  -v, --verbose         send debug messages to the journal. It may be
+                        toggled at runtime by SIGUSR1.
   -d, --delay SECONDS   define delay before sync process starting
+  -t, --timeout SECONDS define deadline for syncing outstanding changes on
+                        termination. It should fit in `TimeoutStopSec` of
+                        the service unit.
+  -T, --trace FILE      record latency from the first event of each path
+                        to completion of its sync. The trace is saved to
+                        FILE in Chrome trace format on SIGUSR2.
   -w, --witelist FILE   path to a file with a list of files to track.
                         File should contain paths relative to source-dri.
                         If not specified, all files from the source directory
@@ -50,18 +62,30 @@ int main([[maybe_unused]] int argc, [[maybe_unused]]char* argv[])
 
     fs::path srcDir, dstDir, whiteListFile;
     std::chrono::seconds delay = std::chrono::minutes{2};
+    std::chrono::seconds timeout = std::chrono::minutes{1};
+    bool native = false;
+    bool archive = false;
+    bool restore = false;
+    fs::path traceFile;
 
     const struct option opts[] = {
         // clang-format off
         { "help",       no_argument,        0, 'h' },
+        { "native",     no_argument,        0, 'n' },
+        { "archive",    no_argument,        0, 'a' },
+        { "restore",    no_argument,        0, 'r' },
+        { "verbose",    no_argument,        0, 'v' },
         { "delay",      required_argument,  0, 'd' },
+        { "timeout",    required_argument,  0, 't' },
+        { "trace",      required_argument,  0, 'T' },
         { "whitelist",  required_argument,  0, 'w' },
         { 0,            0,                  0,  0  },
         // clang-format on
     };
 
     int optVal;
-    while ((optVal = getopt_long(argc, argv, "hd:w:", opts, nullptr)) != -1)
+    while ((optVal = getopt_long(argc, argv, "hnarvd:t:T:w:", opts,
+                                 nullptr)) != -1)
     {
         switch (optVal)
         {
@@ -69,6 +93,22 @@ int main([[maybe_unused]] int argc, [[maybe_unused]]char* argv[])
                 printUsage(argv[0]);
                 return EXIT_SUCCESS;
 
+            case 'n':
+                native = true;
+                break;
+
+            case 'a':
+                archive = true;
+                break;
+
+            case 'r':
+                restore = true;
+                break;
+
+            case 'v':
+                logger::setLevel(logger::Level::DEBUG);
+                break;
+
             case 'd':
                 try
                 {
@@ -82,6 +122,24 @@ int main([[maybe_unused]] int argc, [[maybe_unused]]char* argv[])
                 }
                 break;
 
+            case 't':
+                try
+                {
+                    timeout =
+                        std::chrono::seconds{std::stol(optarg, nullptr, 0)};
+                }
+                catch (const std::invalid_argument&)
+                {
+                    fmt::print(stderr, "Invalid timeout value!\n");
+                    printUsage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+
+            case 'T':
+                traceFile = optarg;
+                break;
+
             case 'w':
                 whiteListFile = optarg;
                 break;
@@ -105,13 +163,28 @@ int main([[maybe_unused]] int argc, [[maybe_unused]]char* argv[])
         return EXIT_FAILURE;
     }
 
+    if (restore)
+    {
+        try
+        {
+            fssync::Archive image(srcDir, true);
+            return image.restore(dstDir) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        catch (const std::exception& e)
+        {
+            fmt::print(stderr, "EXCEPTION: {}\n", e.what());
+            return EXIT_FAILURE;
+        }
+    }
+
     if (!fs::is_directory(srcDir))
     {
         fmt::print(stderr, "Invalid source directory specified!\n");
         return EXIT_FAILURE;
     }
 
-    if (!(fs::is_directory(dstDir) || !fs::exists(dstDir)))
+    if (archive ? fs::is_directory(dstDir)
+                : !(fs::is_directory(dstDir) || !fs::exists(dstDir)))
     {
         fmt::print(stderr, "Invalid destination directory specified!\n");
         return EXIT_FAILURE;
@@ -123,7 +196,8 @@ int main([[maybe_unused]] int argc, [[maybe_unused]]char* argv[])
     {
         sigset_t ss;
         if (sigemptyset(&ss) < 0 || sigaddset(&ss, SIGTERM) < 0 ||
-            sigaddset(&ss, SIGINT) < 0 || sigaddset(&ss, SIGCHLD) < 0)
+            sigaddset(&ss, SIGINT) < 0 || sigaddset(&ss, SIGCHLD) < 0 ||
+            sigaddset(&ss, SIGUSR1) < 0 || sigaddset(&ss, SIGUSR2) < 0)
         {
             fmt::print(stderr, "ERROR: Failed to setup signal handlers, {}\n",
                        strerror(errno));
@@ -137,14 +211,53 @@ int main([[maybe_unused]] int argc, [[maybe_unused]]char* argv[])
             return EXIT_FAILURE;
         }
 
-        sdeventplus::source::Signal sigterm(event, SIGTERM, signalHandler);
-        sdeventplus::source::Signal sigint(event, SIGINT, signalHandler);
-
         fssync::WhiteList whitelist;
         whitelist.load(whiteListFile);
 
         fssync::Sync sync(event, srcDir, dstDir, delay);
         sync.whitelist(whiteListFile);
+        if (archive)
+        {
+            sync.useArchive(dstDir, whitelist.entries());
+        }
+        else if (native)
+        {
+            sync.useNativeEngine();
+        }
+        if (!traceFile.empty())
+        {
+            sync.enableTracing();
+        }
+
+        auto signalHandler = [&sync, &timeout](
+                                 sdeventplus::source::Signal& source,
+                                 const struct signalfd_siginfo*) {
+            fmt::print("\rSignal {} recieved, terminating...\n",
+                       source.get_signal());
+            sync.shutdown(timeout);
+        };
+
+        sdeventplus::source::Signal sigterm(event, SIGTERM, signalHandler);
+        sdeventplus::source::Signal sigint(event, SIGINT, signalHandler);
+
+        auto verboseHandler = [](sdeventplus::source::Signal&,
+                                 const struct signalfd_siginfo*) {
+            bool debug = logger::getLevel() != logger::Level::DEBUG;
+            logger::setLevel(debug ? logger::Level::DEBUG
+                                   : logger::Level::INFO);
+            fmt::print("Log level set to {}\n", debug ? "debug" : "info");
+        };
+        sdeventplus::source::Signal sigusr1(event, SIGUSR1, verboseHandler);
+
+        auto traceHandler = [&sync,
+                             &traceFile](sdeventplus::source::Signal&,
+                                         const struct signalfd_siginfo*) {
+            if (!sync.saveTrace(traceFile))
+            {
+                fmt::print(stderr, "Trace is not saved\n");
+            }
+        };
+        sdeventplus::source::Signal sigusr2(event, SIGUSR2, traceHandler);
 
         auto syncHandler = [&srcDir, &whitelist, &sync](int mask,
                                                         const fs::path& path) {
@@ -0,0 +1,100 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#include "storm.hpp"
+
+#include <phosphor-logging/log.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace fssync
+{
+
+using namespace phosphor::logging;
+
+StormDetector::StormDetector(Duration delay) :
+    decayTime(
+        std::max<Duration>(delay * decayWindows, std::chrono::seconds{1})),
+    quantum(delay / quantaPerDelay)
+{}
+
+double StormDetector::decayed(const Counter& counter, Duration now) const
+{
+    std::chrono::duration<double> elapsed = now - counter.last;
+    return counter.value *
+           std::exp(-elapsed / std::chrono::duration<double>(decayTime));
+}
+
+void StormDetector::cooled(const fs::path& path, const Counter& counter)
+{
+    log<level::INFO>("Write storm ended", entry("PATH=%s", path.c_str()),
+                     entry("EVENTS=%zu", counter.events));
+}
+
+bool StormDetector::update(const fs::path& path, Duration now)
+{
+    auto& counter = counters[path];
+    if (counter.hot)
+    {
+        ++counter.events;
+    }
+    if (counter.value != 0.0 && now - counter.last < quantum)
+    {
+        return counter.hot;
+    }
+
+    counter.value = decayed(counter, now) + 1.0;
+    counter.last = now;
+
+    if (counter.hot)
+    {
+        if (counter.value < coldThreshold)
+        {
+            cooled(path, counter);
+            counter.hot = false;
+        }
+    }
+    else if (counter.value >= hotThreshold)
+    {
+        log<level::WARNING>("Write storm detected, sync of the path is slowed "
+                            "down",
+                            entry("PATH=%s", path.c_str()),
+                            entry("RATE=%.1f", counter.value));
+        counter.hot = true;
+        counter.events = 1;
+    }
+    return counter.hot;
+}
+
+double StormDetector::rate(const fs::path& path, Duration now) const
+{
+    auto it = counters.find(path);
+    return it == counters.end() ? 0.0 : decayed(it->second, now);
+}
+
+void StormDetector::prune(Duration now)
+{
+    for (auto it = counters.begin(); it != counters.end();)
+    {
+        auto value = decayed(it->second, now);
+        if (it->second.hot && value < coldThreshold)
+        {
+            cooled(it->first, it->second);
+            it->second.hot = false;
+        }
+
+        // A counter below one event carries no history worth keeping.
+        if (!it->second.hot && value < 1.0)
+        {
+            it = counters.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+} // namespace fssync
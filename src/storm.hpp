@@ -0,0 +1,99 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <map>
+
+namespace fs = std::filesystem;
+
+namespace fssync
+{
+
+/**
+ * @brief Detects paths rewritten too often (write storms).
+ *
+ * Every path has an exponentially decaying counter of its events. The path
+ * becomes hot once the counter exceeds `hotThreshold` and cools down when
+ * it falls below `coldThreshold`. The events are counted at most once per
+ * 1/`quantaPerDelay` of the sync delay, so a burst of writes saving a file
+ * is a single event, and the counters decay over `decayWindows` delays.
+ * Thus the path becomes hot only after it has been rewritten continuously
+ * for at least two delays, or at a lower rate for longer.
+ */
+class StormDetector
+{
+  public:
+    using Duration = std::chrono::microseconds;
+
+    /** @brief Time constant of the counters decay in sync delays */
+    static constexpr int decayWindows = 8;
+    /** @brief Max number of events counted per sync delay */
+    static constexpr int quantaPerDelay = 4;
+    /** @brief Counter value making the path hot */
+    static constexpr double hotThreshold = 8.0;
+    /** @brief Counter value making the hot path cold */
+    static constexpr double coldThreshold = 3.0;
+
+    /**
+     * @brief ctor
+     *
+     * @param delay - sync delay the events rate is measured against
+     */
+    explicit StormDetector(Duration delay);
+
+    StormDetector() = delete;
+    StormDetector(const StormDetector&) = delete;
+    StormDetector& operator=(const StormDetector&) = delete;
+    StormDetector(StormDetector&&) = delete;
+    StormDetector& operator=(StormDetector&&) = delete;
+    ~StormDetector() = default;
+
+    /**
+     * @brief Account the event for the path.
+     *
+     * @param path - path relative to the source directory
+     * @param now  - monotonic time of the event
+     *
+     * @return true if the path is hot.
+     */
+    bool update(const fs::path& path, Duration now);
+
+    /**
+     * @brief Get the decayed counter value for the path.
+     */
+    double rate(const fs::path& path, Duration now) const;
+
+    /**
+     * @brief Forget the paths which cooled down.
+     */
+    void prune(Duration now);
+
+  private:
+    struct Counter
+    {
+        double value = 0.0;
+        Duration last{};
+        bool hot = false;
+        /** @brief Number of events since the path became hot */
+        size_t events = 0;
+    };
+
+    double decayed(const Counter& counter, Duration now) const;
+
+    /**
+     * @brief Report the path which is not hot anymore.
+     */
+    static void cooled(const fs::path& path, const Counter& counter);
+
+    /** @brief Time constant of the counters decay */
+    Duration decayTime;
+    /** @brief Min interval between the counted events */
+    Duration quantum;
+    std::map<fs::path, Counter> counters;
+};
+
+} // namespace fssync
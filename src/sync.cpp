@@ -4,22 +4,56 @@
  */
 #include "sync.hpp"
 
+#include "archive_engine.hpp"
+#include "logger.hpp"
+
 #include <fmt/printf.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <phosphor-logging/log.hpp>
 #include <sdeventplus/event.hpp>
 
+#include <algorithm>
+#include <fstream>
+#include <thread>
+
 namespace fssync
 {
 
 using namespace phosphor::logging;
 
+/** @brief Max slowdown of the hot paths sync relative to the default delay */
+static constexpr double maxSlowdown = 4.0;
+
+/** @brief Max time the oldest dirty path waits for sync, in default delays */
+static constexpr int maxDebounce = 4;
+
+/** @brief Time the sync process is given to exit on SIGTERM */
+static constexpr std::chrono::seconds killTimeout{1};
+
 inline fs::path addTrailingSlash(const fs::path& path)
 {
     return path.filename().empty() ? path : (path / "");
 }
 
+/**
+ * @brief Move the paths, keep the earliest unsynced event for duplicates.
+ */
+static void mergePaths(Sync::Paths& to, Sync::Paths& from)
+{
+    for (auto& [path, trace] : from)
+    {
+        auto [it, added] = to.emplace(path, trace);
+        if (!added && trace.event < it->second.event)
+        {
+            it->second = trace;
+        }
+    }
+    from.clear();
+}
+
 Sync::Sync(sdeventplus::Event& event, const fs::path& src, const fs::path& dst,
            const std::chrono::seconds& delay) :
     event(event),
@@ -27,31 +61,302 @@ Sync::Sync(sdeventplus::Event& event, const fs::path& src, const fs::path& dst,
     timer(event, {}, std::chrono::microseconds{1},
           std::bind(&Sync::handleTimer, this, std::placeholders::_1,
                     std::placeholders::_2)),
-    defaultDelay(delay)
+    defaultDelay(delay),
+    hotTimer(event, {}, std::chrono::microseconds{1},
+             std::bind(&Sync::handleHotTimer, this, std::placeholders::_1,
+                       std::placeholders::_2)),
+    storms(delay)
 {
+    hotTimer.set_enabled(sdeventplus::source::Enabled::Off);
     startTimer(defaultDelay);
 }
 
+Sync::~Sync()
+{
+    if (!dirtyListFile.empty())
+    {
+        std::error_code ec;
+        fs::remove(dirtyListFile, ec);
+    }
+}
+
 void Sync::whitelist(const fs::path& filename)
 {
     whiteListFile = filename;
 }
 
-int Sync::processEntry(int, const fs::path&)
+void Sync::useNativeEngine(size_t depth)
 {
-    startTimer(defaultDelay);
+    engine = Engine::create(event, source, destination, depth);
+}
+
+void Sync::useArchive(const fs::path& image,
+                      const std::vector<fs::path>& roots)
+{
+    // The image is reconciled with the tracked set by the first batch,
+    // which is started by the initial timer.
+    auto tracked = roots;
+    if (whiteListFile.empty())
+    {
+        tracked.emplace_back();
+    }
+    engine = std::make_unique<ArchiveEngine>(event, source, image, tracked);
+
+    fullSyncPending = false;
+    for (const auto& root : tracked)
+    {
+        dirty.emplace(root, PathTrace{timestamp()});
+    }
+}
+
+void Sync::enableTracing()
+{
+    tracer = std::make_unique<Tracer>();
+}
+
+bool Sync::saveTrace(const fs::path& file) const
+{
+    return tracer && tracer->save(file);
+}
+
+uint64_t Sync::timestamp() const
+{
+    return Clock(event).now().time_since_epoch().count();
+}
+
+void Sync::schedule(Paths& paths)
+{
+    auto now = timestamp();
+    for (auto& [path, trace] : paths)
+    {
+        if (trace.scheduled == 0)
+        {
+            trace.scheduled = now;
+        }
+    }
+}
+
+void Sync::takeDirty(Paths& paths)
+{
+    schedule(paths);
+    auto now = timestamp();
+    for (auto& [path, trace] : paths)
+    {
+        trace.started = now;
+    }
+    mergePaths(inFlight, paths);
+}
+
+int Sync::processEntry(int, const fs::path& entryPath)
+{
+    // The loop iteration time is the time the inotify event was read.
+    auto now = Clock(event).now();
+    PathTrace trace{static_cast<uint64_t>(now.time_since_epoch().count())};
+    if (storms.update(entryPath, now.time_since_epoch()))
+    {
+        // Events of the hot path don't postpone sync of the other paths.
+        // It is synced with its own cadence, slowed down proportionally to
+        // the rate of its events.
+        hotDirty.emplace(entryPath, trace);
+        if (!stopping &&
+            hotTimer.get_enabled() == sdeventplus::source::Enabled::Off)
+        {
+            auto slowdown = std::clamp(
+                storms.rate(entryPath, now.time_since_epoch()) /
+                    StormDetector::hotThreshold,
+                1.0, maxSlowdown);
+            hotTimer.set_time(
+                now + std::chrono::duration_cast<std::chrono::microseconds>(
+                          defaultDelay * slowdown));
+            hotTimer.set_enabled(sdeventplus::source::Enabled::OneShot);
+        }
+        return 0;
+    }
+
+    // Every event postpones the sync, but not beyond the debounce deadline
+    // set by the first path changed since the last sync was started.
+    if (dirty.empty())
+    {
+        debounceDeadline = now + defaultDelay * maxDebounce;
+    }
+    dirty.emplace(entryPath, trace);
+    if (!stopping)
+    {
+        timer.set_time(std::min<Time::TimePoint>(now + defaultDelay,
+                                                 debounceDeadline));
+        timer.set_enabled(sdeventplus::source::Enabled::OneShot);
+    }
     return 0;
 }
 
-void Sync::doSync()
+bool Sync::isRunning() const
+{
+    return (childPtr &&
+            childPtr->get_enabled() != sdeventplus::source::Enabled::Off) ||
+           (engine && engine->isRunning());
+}
+
+void Sync::cancel()
 {
     if (childPtr &&
         childPtr->get_enabled() != sdeventplus::source::Enabled::Off)
     {
-        log<level::DEBUG>("SYNC: Process already started");
+        kill(childPtr->get_pid(), SIGTERM);
+    }
+    if (engine)
+    {
+        engine->cancel();
+    }
+}
+
+void Sync::forceExit(int code)
+{
+    cancel();
+    if (childPtr &&
+        childPtr->get_enabled() != sdeventplus::source::Enabled::Off)
+    {
+        // The loop is about to exit, so the sync process is reaped here
+        // to not leave it running without the daemon.
+        auto pid = childPtr->get_pid();
+        auto deadline = std::chrono::steady_clock::now() + killTimeout;
+        while (waitpid(pid, nullptr, WNOHANG) == 0)
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                log<level::WARNING>("Sync process doesn't exit, kill it",
+                                    entry("PID=%d", pid));
+                kill(pid, SIGKILL);
+                waitpid(pid, nullptr, 0);
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+        }
+        childPtr->set_enabled(sdeventplus::source::Enabled::Off);
+    }
+    event.exit(code);
+}
+
+void Sync::doSync()
+{
+    if (isRunning())
+    {
+        logger::log<level::DEBUG>("SYNC: Process already started");
         startTimer(std::chrono::seconds{10});
+        return;
+    }
+
+    // The native engine transfers only the changed paths, so it can't be
+    // used until the tracked set is reconciled by rsync.
+    if (engine && !fullSyncPending)
+    {
+        startBatch();
+        return;
     }
 
+    // The whole tracked set is transferred, so any path marked dirty so far
+    // will be synced by this process.
+    takeDirty(dirty);
+    takeDirty(hotDirty);
+    hotTimer.set_enabled(sdeventplus::source::Enabled::Off);
+    startSync(whiteListFile);
+}
+
+void Sync::startBatch()
+{
+    if (dirty.empty())
+    {
+        return;
+    }
+
+    log<level::INFO>("Start sync batch", entry("COUNT=%zu", dirty.size()));
+
+    std::vector<fs::path> batch;
+    batch.reserve(dirty.size());
+    for (const auto& [path, trace] : dirty)
+    {
+        // Directories are transferred recursively, so their entries must
+        // not be processed concurrently with them.
+        bool nested = !path.empty() && dirty.count(fs::path());
+        for (auto parent = path.parent_path(); !nested && !parent.empty();
+             parent = parent.parent_path())
+        {
+            nested = dirty.count(parent) != 0;
+        }
+        if (!nested)
+        {
+            batch.emplace_back(path);
+        }
+    }
+    takeDirty(dirty);
+    ++jobs;
+    engine->start(std::move(batch), std::bind(&Sync::syncFinished, this,
+                                              std::placeholders::_1));
+}
+
+void Sync::flushDirty()
+{
+    mergePaths(dirty, hotDirty);
+
+    // Changes made while the daemon was not running are found by the
+    // startup sync only, so it can't be replaced by the dirty paths.
+    if (fullSyncPending)
+    {
+        log<level::INFO>("SYNC: Startup sync is pending, sync tracked set");
+        finalSync = true;
+        takeDirty(dirty);
+        startSync(whiteListFile);
+        return;
+    }
+
+    if (dirty.empty())
+    {
+        log<level::INFO>("SYNC: No outstanding changes");
+        event.exit(EXIT_SUCCESS);
+        return;
+    }
+
+    log<level::INFO>("SYNC: Flush outstanding changes",
+                     entry("COUNT=%zu", dirty.size()));
+    finalSync = true;
+
+    if (engine)
+    {
+        startBatch();
+        return;
+    }
+
+    char listFile[] = "/tmp/fssync-dirty.XXXXXX";
+    int fd = mkstemp(listFile);
+    if (fd == -1)
+    {
+        log<level::ERR>("mkstemp failed", entry("ERROR=%s", strerror(errno)));
+        event.exit(EXIT_FAILURE);
+        return;
+    }
+    close(fd);
+    dirtyListFile = listFile;
+
+    std::ofstream list(dirtyListFile, std::ios::trunc | std::ios::binary);
+    for (const auto& [path, trace] : dirty)
+    {
+        list << path.native() << '\0';
+    }
+    list.close();
+    if (!list)
+    {
+        log<level::ERR>("Failed to write list of changed files",
+                        entry("FILE=%s", dirtyListFile.c_str()));
+        event.exit(EXIT_FAILURE);
+        return;
+    }
+
+    takeDirty(dirty);
+    startSync(dirtyListFile, true);
+}
+
+void Sync::startSync(const fs::path& filesFrom, bool from0)
+{
+    ++jobs;
     pid_t pid = fork();
     if (pid == 0)
     {
@@ -63,18 +368,29 @@ void Sync::doSync()
             "--delete-missing-args",
         };
 
-        if (!whiteListFile.empty())
+        if (!filesFrom.empty())
         {
             cmd.emplace_back("--files-from");
-            cmd.emplace_back(whiteListFile.c_str());
+            cmd.emplace_back(filesFrom.c_str());
+        }
+        if (from0)
+        {
+            cmd.emplace_back("--from0");
         }
         cmd.emplace_back(source.c_str());
         cmd.emplace_back(destination.c_str());
         cmd.emplace_back(nullptr);
 
+        // The signals handled by the daemon are blocked, and the mask is
+        // inherited through execv, so rsync couldn't be terminated.
+        sigset_t ss;
+        sigemptyset(&ss);
+        sigprocmask(SIG_SETMASK, &ss, nullptr);
+
         execv(cmd[0], const_cast<char* const*>(cmd.data()));
 
         log<level::ERR>("execv failed", entry("ERROR=%s", strerror(errno)));
+        _exit(EXIT_FAILURE);
     }
     else if (pid > 0)
     {
@@ -87,9 +403,42 @@ void Sync::doSync()
     else
     {
         log<level::ERR>("fork failed", entry("ERROR=%s", strerror(errno)));
+        mergePaths(dirty, inFlight);
+        if (stopping)
+        {
+            event.exit(EXIT_FAILURE);
+        }
     }
 }
 
+void Sync::shutdown(const std::chrono::seconds& timeout)
+{
+    if (stopping)
+    {
+        log<level::WARNING>("SYNC: Shutdown forced, outstanding changes lost",
+                            entry("COUNT=%zu", dirty.size() + hotDirty.size() +
+                                                   inFlight.size()));
+        forceExit(EXIT_FAILURE);
+        return;
+    }
+
+    stopping = true;
+    timer.set_enabled(sdeventplus::source::Enabled::Off);
+    hotTimer.set_enabled(sdeventplus::source::Enabled::Off);
+    deadlinePtr = std::make_unique<Time>(
+        event, Clock(event).now() + timeout, std::chrono::milliseconds{100},
+        std::bind(&Sync::handleDeadline, this, std::placeholders::_1,
+                  std::placeholders::_2));
+
+    if (isRunning())
+    {
+        log<level::INFO>("SYNC: Waiting for the running sync process");
+        return;
+    }
+
+    flushDirty();
+}
+
 void Sync::handleChild(sdeventplus::source::Child& source, const siginfo_t* si)
 {
     if (!si)
@@ -98,12 +447,14 @@ void Sync::handleChild(sdeventplus::source::Child& source, const siginfo_t* si)
         return;
     }
 
+    bool success = false;
     switch (si->si_code)
     {
         case CLD_EXITED:
             if (si->si_status == EXIT_SUCCESS)
             {
                 log<level::INFO>("Sync process successful completed.");
+                success = true;
             }
             else
             {
@@ -116,13 +467,13 @@ void Sync::handleChild(sdeventplus::source::Child& source, const siginfo_t* si)
             log<level::INFO>("Sync process stopped",
                              entry("STATUS=%d", si->si_status));
             source.set_enabled(sdeventplus::source::Enabled::OneShot);
-            break;
+            return;
 
         case CLD_CONTINUED:
             log<level::INFO>("Sync process continued",
                              entry("STATUS=%d", si->si_status));
             source.set_enabled(sdeventplus::source::Enabled::OneShot);
-            break;
+            return;
 
         case CLD_KILLED:
             log<level::WARNING>("Sync process killed by signal",
@@ -141,11 +492,88 @@ void Sync::handleChild(sdeventplus::source::Child& source, const siginfo_t* si)
                             entry("STATUS=%d", si->si_status));
             break;
     }
+
+    if (!dirtyListFile.empty())
+    {
+        std::error_code ec;
+        fs::remove(dirtyListFile, ec);
+        dirtyListFile.clear();
+    }
+    else if (success)
+    {
+        fullSyncPending = false;
+    }
+
+    syncFinished(success);
+}
+
+void Sync::syncFinished(bool success)
+{
+    if (tracer)
+    {
+        auto now = timestamp();
+        for (const auto& [path, trace] : inFlight)
+        {
+            tracer->add(path, jobs, trace, now, success);
+        }
+    }
+
+    // Paths from the failed sync should be transferred next time.
+    if (!success)
+    {
+        for (auto& [path, trace] : inFlight)
+        {
+            trace.scheduled = trace.started = 0;
+        }
+        mergePaths(dirty, inFlight);
+    }
+    inFlight.clear();
+
+    if (stopping)
+    {
+        if (finalSync)
+        {
+            event.exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        else
+        {
+            // The sync source can't be replaced from its own callback,
+            // so the flush is started on the next loop iteration.
+            startTimer(std::chrono::seconds{0});
+        }
+    }
 }
 
-void Sync::handleTimer(Time&, Time::TimePoint)
+void Sync::handleTimer(Time&, Time::TimePoint timePoint)
 {
+    storms.prune(timePoint.time_since_epoch());
+    schedule(dirty);
+    if (stopping)
+    {
+        flushDirty();
+    }
+    else
+    {
+        doSync();
+    }
+}
+
+void Sync::handleHotTimer(Time&, Time::TimePoint timePoint)
+{
+    log<level::INFO>("SYNC: Sync hot paths",
+                     entry("COUNT=%zu", hotDirty.size()));
+    storms.prune(timePoint.time_since_epoch());
+    schedule(hotDirty);
+    mergePaths(dirty, hotDirty);
     doSync();
 }
 
+void Sync::handleDeadline(Time&, Time::TimePoint)
+{
+    log<level::ERR>("SYNC: Shutdown timeout expired, outstanding changes lost",
+                    entry("COUNT=%zu",
+                          dirty.size() + hotDirty.size() + inFlight.size()));
+    forceExit(ETIMEDOUT);
+}
+
 } // namespace fssync
@@ -4,6 +4,10 @@
  */
 #pragma once
 
+#include "engine.hpp"
+#include "storm.hpp"
+#include "trace.hpp"
+
 #include <fmt/printf.h>
 
 #include <sdeventplus/clock.hpp>
@@ -11,6 +15,7 @@
 #include <sdeventplus/source/time.hpp>
 
 #include <filesystem>
+#include <map>
 
 namespace fs = std::filesystem;
 
@@ -26,24 +31,127 @@ class Sync
     static constexpr auto clockId = sdeventplus::ClockId::Monotonic;
     using Clock = sdeventplus::Clock<clockId>;
     using Time = sdeventplus::source::Time<clockId>;
+    using Paths = std::map<fs::path, PathTrace>;
 
     Sync() = delete;
     Sync(const Sync&) = delete;
     Sync& operator=(const Sync&) = delete;
     Sync(Sync&&) = delete;
     Sync& operator=(Sync&&) = delete;
-    ~Sync() = default;
+    ~Sync();
 
     Sync(sdeventplus::Event& event, const fs::path& src, const fs::path& dst,
          const std::chrono::seconds& delay);
     void whitelist(const fs::path& filename);
+
+    /**
+     * @brief Transfer the changed paths by the in-process copy engine
+     * instead of rsync.
+     *
+     * @param depth - max number of files processed simultaneously
+     */
+    void useNativeEngine(size_t depth = Engine::defaultDepth);
+
+    /**
+     * @brief Keep the tracked files in the compressed image instead of the
+     * destination directory.
+     *
+     * @param image - path to the image file
+     * @param roots - tracked paths relative to the source directory
+     */
+    void useArchive(const fs::path& image, const std::vector<fs::path>& roots);
+
     int processEntry(int mask, const fs::path& entryPath);
 
+    /**
+     * @brief Flush the outstanding changes and exit the event loop.
+     *
+     * Waits for the running sync process, then syncs only the paths changed
+     * since the last successful sync, or the whole tracked set if the startup
+     * sync has not succeeded yet. If the work is not done until the timeout
+     * expires, the sync process is terminated.
+     *
+     * @param timeout - deadline for the whole shutdown sequence
+     */
+    void shutdown(const std::chrono::seconds& timeout);
+
+    /**
+     * @brief Start recording latency of the paths from the first event to
+     * completion of the sync job.
+     */
+    void enableTracing();
+
+    /**
+     * @brief Save the recorded latency trace in Chrome trace format.
+     *
+     * @return false if tracing is disabled or on error.
+     */
+    bool saveTrace(const fs::path& file) const;
+
   protected:
     void doSync();
 
+    /**
+     * @brief Start rsync process for the specified list of files.
+     *
+     * @param filesFrom - file with a list of files to transfer, if empty all
+     *                    files from the source directory will be transferred.
+     * @param from0     - entries in the list are separated with '\0'
+     */
+    void startSync(const fs::path& filesFrom, bool from0 = false);
+
+    /**
+     * @brief Get the current loop iteration monotonic time in microseconds.
+     */
+    uint64_t timestamp() const;
+
+    /**
+     * @brief Mark the paths as scheduled for sync if not marked yet.
+     */
+    void schedule(Paths& paths);
+
+    /**
+     * @brief Move the paths to the set being transferred by the new job.
+     */
+    void takeDirty(Paths& paths);
+
+    /**
+     * @brief Transfer the changed paths by the native engine.
+     */
+    void startBatch();
+
+    /**
+     * @brief Sync only the paths changed since the last successful sync.
+     */
+    void flushDirty();
+
+    /**
+     * @brief Handle completion of the sync process or the native engine.
+     */
+    void syncFinished(bool success);
+
+    /**
+     * @brief Terminate the running sync.
+     */
+    void cancel();
+
+    /**
+     * @brief Terminate the running sync, make sure the sync process is gone
+     * and exit the event loop.
+     *
+     * @param code - exit code of the event loop
+     */
+    void forceExit(int code);
+
+    /**
+     * @brief Check whether the sync process is running.
+     */
+    bool isRunning() const;
+
     void handleChild(sdeventplus::source::Child& source, const siginfo_t* si);
     void handleTimer(Time& source, Time::TimePoint timePoint);
+    void handleHotTimer(Time& source, Time::TimePoint timePoint);
+    void handleDeadline(Time& source, Time::TimePoint timePoint);
 
     template <class R, class P>
     void startTimer(const std::chrono::duration<R, P>& delay)
@@ -60,5 +168,31 @@ class Sync
     std::unique_ptr<sdeventplus::source::Child> childPtr;
     Time timer;
     std::chrono::seconds defaultDelay;
+
+    /** @brief Paths changed since the last sync process was started. */
+    Paths dirty;
+    /** @brief Latest time the sync of the dirty paths can be postponed to. */
+    Time::TimePoint debounceDeadline;
+    /** @brief Hot paths changed since the last sync process was started. */
+    Paths hotDirty;
+    /** @brief Schedules sync of the hot paths, not postponed by events. */
+    Time hotTimer;
+    StormDetector storms;
+    /** @brief Paths being transferred by the running sync process. */
+    Paths inFlight;
+    /** @brief Temporary list of files for the running sync process. */
+    fs::path dirtyListFile;
+
+    bool stopping = false;
+    bool finalSync = false;
+    std::unique_ptr<Time> deadlinePtr;
+
+    std::unique_ptr<Engine> engine;
+    /** @brief The tracked set has not been reconciled by rsync yet. */
+    bool fullSyncPending = true;
+
+    std::unique_ptr<Tracer> tracer;
+    /** @brief Number of the last started sync job */
+    uint32_t jobs = 0;
 };
 } // namespace fssync
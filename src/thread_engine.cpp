@@ -0,0 +1,128 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#include "thread_engine.hpp"
+
+namespace fssync
+{
+
+ThreadEngine::ThreadEngine(sdeventplus::Event& event, const fs::path& src,
+                           const fs::path& dst, size_t threads) :
+    Engine(event, src, dst)
+{
+    for (size_t i = 0; i < threads; ++i)
+    {
+        workers.emplace_back(&ThreadEngine::worker, this);
+    }
+}
+
+ThreadEngine::~ThreadEngine()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.clear();
+        stop = true;
+    }
+    cv.notify_all();
+    for (auto& thread : workers)
+    {
+        thread.join();
+    }
+}
+
+void ThreadEngine::cancel()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!queue.empty())
+    {
+        remaining -= queue.size();
+        queue.clear();
+        failed = true;
+        if (remaining == 0)
+        {
+            notify();
+        }
+    }
+}
+
+void ThreadEngine::submit(std::vector<fs::path>&& batch)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        remaining = batch.size();
+        failed = false;
+        touched.clear();
+        queue.insert(queue.end(), std::make_move_iterator(batch.begin()),
+                     std::make_move_iterator(batch.end()));
+    }
+
+    if (batch.empty())
+    {
+        notify();
+    }
+    cv.notify_all();
+}
+
+void ThreadEngine::complete()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (remaining == 0)
+    {
+        bool success = !failed;
+        lock.unlock();
+        finish(success);
+    }
+}
+
+void ThreadEngine::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        cv.wait(lock, [this] { return stop || !queue.empty(); });
+        if (stop)
+        {
+            break;
+        }
+
+        auto path = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+
+        std::vector<fs::path> children;
+        std::set<fs::path> dirs;
+        bool ok = details::copyEntry(source / path, destination / path,
+                                     children, dirs);
+
+        lock.lock();
+        failed = failed || !ok;
+        touched.merge(dirs);
+        for (const auto& child : children)
+        {
+            queue.emplace_back(path / child);
+        }
+        remaining += children.size();
+        if (!children.empty())
+        {
+            cv.notify_all();
+        }
+        if (remaining == 1 && !touched.empty())
+        {
+            // The last entry of the batch is done, flush the directories
+            // to make the renames durable before reporting completion.
+            dirs = std::move(touched);
+            touched.clear();
+            lock.unlock();
+            ok = details::syncDirectories(dirs);
+            lock.lock();
+            failed = failed || !ok;
+        }
+        if (--remaining == 0)
+        {
+            notify();
+        }
+    }
+}
+
+} // namespace fssync
@@ -0,0 +1,60 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#pragma once
+
+#include "engine.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace fssync
+{
+
+/**
+ * @brief Copy engine doing blocking I/O in a pool of worker threads.
+ *
+ * Used on kernels without io_uring support.
+ */
+class ThreadEngine : public Engine
+{
+  public:
+    /**
+     * @brief ctor - start worker threads
+     *
+     * @param event   - sd-event object
+     * @param src     - source directory
+     * @param dst     - destination directory
+     * @param threads - number of worker threads
+     */
+    ThreadEngine(sdeventplus::Event& event, const fs::path& src,
+                 const fs::path& dst, size_t threads);
+
+    /**
+     * @brief dtor - wait for the files being copied and stop worker threads
+     */
+    ~ThreadEngine() override;
+
+    void cancel() override;
+
+  protected:
+    void submit(std::vector<fs::path>&& batch) override;
+    void complete() override;
+
+  private:
+    void worker();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<fs::path> queue;
+    std::set<fs::path> touched;
+    size_t remaining = 0;
+    bool failed = false;
+    bool stop = false;
+    std::vector<std::thread> workers;
+};
+
+} // namespace fssync
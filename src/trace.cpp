@@ -0,0 +1,104 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#include "trace.hpp"
+
+#include <fmt/format.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <fstream>
+#include <map>
+
+namespace fssync
+{
+
+using namespace phosphor::logging;
+
+static std::string escape(const std::string& str)
+{
+    std::string out;
+    out.reserve(str.size());
+    for (auto c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            out += fmt::format("\\u{:04x}", static_cast<int>(c));
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out;
+}
+
+void Tracer::add(const fs::path& path, uint32_t job, const PathTrace& trace,
+                 uint64_t done, bool success)
+{
+    records[head++ % capacity] = {path, job, success, trace, done};
+}
+
+bool Tracer::save(const fs::path& file) const
+{
+    std::ofstream out(file, std::ios::trunc);
+    out << R"({"displayTimeUnit":"ms","traceEvents":[)"
+        << R"({"name":"process_name","ph":"M","pid":1,)"
+        << R"("args":{"name":"fssyncd"}})";
+
+    auto begin = head > capacity ? head - capacity : 0;
+    // Track ids are assigned to the paths present in the ring only.
+    std::map<fs::path, size_t> tracks;
+    size_t count = 0;
+
+    for (auto index = begin; index < head; ++index)
+    {
+        const auto& record = records[index % capacity];
+
+        // Every path is a separate track named after it.
+        auto [it, added] = tracks.emplace(record.path, tracks.size());
+        auto tid = it->second;
+        if (added)
+        {
+            out << fmt::format(
+                R"(,{{"name":"thread_name","ph":"M","pid":1,"tid":{},)"
+                R"("args":{{"name":"{}"}}}})",
+                tid, escape(record.path.native()));
+        }
+
+        const auto& trace = record.trace;
+        auto span = [&](const char* name, uint64_t from, uint64_t to) {
+            if (from != 0 && to >= from)
+            {
+                out << fmt::format(
+                    R"(,{{"name":"{}","cat":"sync","ph":"X","pid":1,)"
+                    R"("tid":{},"ts":{},"dur":{},)"
+                    R"("args":{{"job":{},"success":{}}}}})",
+                    name, tid, from, to - from, record.job, record.success);
+            }
+        };
+        span("debounce", trace.event, trace.scheduled);
+        span("queued", trace.scheduled, trace.started);
+        span("write", trace.started, record.done);
+        ++count;
+    }
+    out << "]}\n";
+    out.close();
+
+    if (!out)
+    {
+        log<level::ERR>("Failed to save trace", entry("FILE=%s", file.c_str()));
+        return false;
+    }
+    log<level::INFO>("Trace saved", entry("FILE=%s", file.c_str()),
+                     entry("RECORDS=%zu", count));
+    return true;
+}
+
+} // namespace fssync
@@ -0,0 +1,84 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+namespace fssync
+{
+
+/**
+ * @brief Monotonic timestamps (in microseconds) of the dirty path passing
+ * through the sync pipeline, zero if the stage is not reached yet.
+ */
+struct PathTrace
+{
+    /** @brief The first event not synced yet */
+    uint64_t event = 0;
+    /** @brief The sync timer expired, debounce delay is over */
+    uint64_t scheduled = 0;
+    /** @brief The sync job transferring the path started */
+    uint64_t started = 0;
+};
+
+/**
+ * @brief Keeps the latest event-to-durable latency records in a ring buffer
+ * and exports them in Chrome trace format.
+ *
+ * Records are added and saved by the event loop only, so the ring takes no
+ * synchronization.
+ */
+class Tracer
+{
+  public:
+    static constexpr size_t capacity = 4096;
+
+    Tracer() = default;
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+    Tracer(Tracer&&) = delete;
+    Tracer& operator=(Tracer&&) = delete;
+    ~Tracer() = default;
+
+    /**
+     * @brief Record the path completed by the sync job.
+     *
+     * @param path    - path relative to the source directory
+     * @param job     - sync job number
+     * @param trace   - timestamps of the pipeline stages
+     * @param done    - timestamp of the job completion
+     * @param success - the job result
+     */
+    void add(const fs::path& path, uint32_t job, const PathTrace& trace,
+             uint64_t done, bool success);
+
+    /**
+     * @brief Write the records to the JSON file loadable by chrome://tracing
+     * and Perfetto UI.
+     *
+     * @return false on error.
+     */
+    bool save(const fs::path& file) const;
+
+  private:
+    struct Record
+    {
+        fs::path path;
+        uint32_t job;
+        bool success;
+        PathTrace trace;
+        uint64_t done;
+    };
+
+    std::array<Record, capacity> records;
+    /** @brief Number of the records ever added */
+    uint64_t head = 0;
+};
+
+} // namespace fssync
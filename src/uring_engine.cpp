@@ -0,0 +1,456 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#include "uring_engine.hpp"
+
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <unistd.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace fssync
+{
+
+using namespace phosphor::logging;
+
+static constexpr size_t chunkSize = 64 * 1024;
+
+UringEngine::UringEngine(sdeventplus::Event& event, const fs::path& src,
+                         const fs::path& dst, size_t depth) :
+    Engine(event, src, dst),
+    depth(depth)
+{
+    // Every file being processed has at most one request in flight.
+    auto rc = io_uring_queue_init(depth, &ring, 0);
+    if (rc < 0)
+    {
+        throw std::runtime_error(
+            fmt::format("io_uring_queue_init() failed, {}", strerror(-rc)));
+    }
+
+    auto probe = io_uring_get_probe_ring(&ring);
+    bool supported = probe != nullptr;
+    for (auto op : {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ,
+                    IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_RENAMEAT})
+    {
+        supported = supported && io_uring_opcode_supported(probe, op);
+    }
+    if (probe)
+    {
+        io_uring_free_probe(probe);
+    }
+    if (!supported)
+    {
+        io_uring_queue_exit(&ring);
+        throw std::runtime_error("required io_uring operations are missing");
+    }
+
+    rc = io_uring_register_eventfd(&ring, notifyFd());
+    if (rc < 0)
+    {
+        io_uring_queue_exit(&ring);
+        throw std::runtime_error(fmt::format(
+            "io_uring_register_eventfd() failed, {}", strerror(-rc)));
+    }
+
+    thread = std::thread(&UringEngine::worker, this);
+}
+
+UringEngine::~UringEngine()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    thread.join();
+
+    // The kernel may still write into the buffers of the active files,
+    // so wait for their requests before releasing them.
+    auto requests = std::count_if(
+        active.begin(), active.end(),
+        [](const auto& file) { return !isBlocking(file->stage); });
+    for (; requests > 0; --requests)
+    {
+        struct io_uring_cqe* cqe;
+        if (io_uring_wait_cqe(&ring, &cqe) == 0)
+        {
+            io_uring_cqe_seen(&ring, cqe);
+        }
+    }
+    for (auto& file : active)
+    {
+        release(*file, false);
+    }
+    io_uring_queue_exit(&ring);
+}
+
+void UringEngine::cancel()
+{
+    if (!queue.empty())
+    {
+        queue.clear();
+        failed = true;
+    }
+    if (active.empty())
+    {
+        notify();
+    }
+}
+
+void UringEngine::submit(std::vector<fs::path>&& batch)
+{
+    failed = false;
+    touched.clear();
+    queue.insert(queue.end(), std::make_move_iterator(batch.begin()),
+                 std::make_move_iterator(batch.end()));
+    fill();
+    if (active.empty())
+    {
+        notify();
+    }
+}
+
+void UringEngine::complete()
+{
+    struct io_uring_cqe* cqe;
+    while (io_uring_peek_cqe(&ring, &cqe) == 0)
+    {
+        auto file = static_cast<File*>(io_uring_cqe_get_data(cqe));
+        auto res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        handleResult(file, res);
+    }
+
+    std::vector<std::pair<File*, int>> results;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        results.swap(blockingDone);
+    }
+    for (const auto& [file, res] : results)
+    {
+        handleResult(file, res);
+    }
+
+    fill();
+    if (active.empty() && queue.empty() && isRunning())
+    {
+        if (touched.empty())
+        {
+            finish(!failed);
+            return;
+        }
+
+        // Renames are durable only when their directories are flushed.
+        auto file = std::make_unique<File>();
+        file->stage = Stage::SyncDirs;
+        file->touched.swap(touched);
+        prepare(*file);
+        active.emplace_back(std::move(file));
+    }
+}
+
+void UringEngine::handleResult(File* file, int res)
+{
+    if (!advance(*file, res))
+    {
+        active.erase(std::find_if(
+            active.begin(), active.end(),
+            [file](const auto& item) { return item.get() == file; }));
+    }
+}
+
+bool UringEngine::isBlocking(Stage stage)
+{
+    return stage == Stage::Prepare || stage == Stage::Attributes ||
+           stage == Stage::Entry || stage == Stage::SyncDirs;
+}
+
+void UringEngine::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        cv.wait(lock, [this] { return stop || !blocking.empty(); });
+        if (stop)
+        {
+            break;
+        }
+
+        auto file = blocking.front();
+        blocking.pop_front();
+        lock.unlock();
+
+        int res = 0;
+        switch (file->stage)
+        {
+            case Stage::Prepare:
+            {
+                std::error_code ec;
+                details::createDirectories(fs::path(file->dst).parent_path(),
+                                           file->touched, ec);
+                res = -ec.value();
+                break;
+            }
+
+            case Stage::Attributes:
+                if (!details::copyAttributes(file->dstFd, file->stx))
+                {
+                    res = -errno;
+                }
+                break;
+
+            case Stage::Entry:
+                if (!details::copyEntry(file->src, file->dst, file->children,
+                                        file->touched))
+                {
+                    res = -EIO;
+                }
+                break;
+
+            case Stage::SyncDirs:
+                if (!details::syncDirectories(file->touched))
+                {
+                    res = -EIO;
+                }
+                break;
+
+            default:
+                break;
+        }
+
+        lock.lock();
+        blockingDone.emplace_back(file, res);
+        notify();
+    }
+}
+
+void UringEngine::fill()
+{
+    while (active.size() < depth && !queue.empty())
+    {
+        auto path = std::move(queue.front());
+        queue.pop_front();
+
+        auto file = std::make_unique<File>();
+        file->path = path;
+        file->src = source / path;
+        file->dst = destination / path;
+        file->tmp = details::tempPath(destination / path);
+        if (prepare(*file))
+        {
+            active.emplace_back(std::move(file));
+        }
+        else
+        {
+            failed = true;
+        }
+    }
+
+    // All the requests prepared while handling completions go in one batch.
+    io_uring_submit(&ring);
+}
+
+bool UringEngine::prepare(File& file)
+{
+    if (isBlocking(file.stage))
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            blocking.push_back(&file);
+        }
+        cv.notify_one();
+        return true;
+    }
+
+    auto sqe = io_uring_get_sqe(&ring);
+    if (!sqe)
+    {
+        log<level::ERR>("io_uring submission queue is full",
+                        entry("PATH=%s", file.src.c_str()));
+        return false;
+    }
+
+    switch (file.stage)
+    {
+        case Stage::Statx:
+            io_uring_prep_statx(sqe, AT_FDCWD, file.src.c_str(),
+                                AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS,
+                                &file.stx);
+            break;
+
+        case Stage::OpenSrc:
+            io_uring_prep_openat(sqe, AT_FDCWD, file.src.c_str(),
+                                 O_RDONLY | O_CLOEXEC, 0);
+            break;
+
+        case Stage::OpenDst:
+            io_uring_prep_openat(sqe, AT_FDCWD, file.tmp.c_str(),
+                                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                 0600);
+            break;
+
+        case Stage::Read:
+            io_uring_prep_read(sqe, file.srcFd, file.buffer.data(),
+                               file.buffer.size(), file.offset);
+            break;
+
+        case Stage::Write:
+            io_uring_prep_write(sqe, file.dstFd,
+                                file.buffer.data() + file.written,
+                                file.length - file.written,
+                                file.offset + file.written);
+            break;
+
+        case Stage::Fsync:
+            io_uring_prep_fsync(sqe, file.dstFd, 0);
+            break;
+
+        case Stage::Rename:
+            io_uring_prep_renameat(sqe, AT_FDCWD, file.tmp.c_str(), AT_FDCWD,
+                                   file.dst.c_str(), 0);
+            break;
+
+        default:
+            break;
+    }
+
+    io_uring_sqe_set_data(sqe, &file);
+    return true;
+}
+
+bool UringEngine::advance(File& file, int res)
+{
+    if (file.stage == Stage::Statx &&
+        (res == -ENOENT || (res == 0 && !S_ISREG(file.stx.stx_mode))))
+    {
+        // Removed entries, directories and symlinks take no data I/O.
+        file.stage = Stage::Entry;
+        return prepare(file);
+    }
+
+    if (file.stage == Stage::SyncDirs)
+    {
+        failed = failed || res < 0;
+        return false;
+    }
+
+    if (file.stage == Stage::Write && res == 0)
+    {
+        res = -EIO;
+    }
+
+    if (res < 0)
+    {
+        log<level::ERR>("Failed to transfer entry",
+                        entry("PATH=%s", file.src.c_str()),
+                        entry("STAGE=%d", static_cast<int>(file.stage)),
+                        entry("ERROR=%s", strerror(-res)));
+        release(file, false);
+        failed = true;
+        return false;
+    }
+
+    switch (file.stage)
+    {
+        case Stage::Statx:
+            file.stage = Stage::Prepare;
+            break;
+
+        case Stage::Prepare:
+            touched.merge(file.touched);
+            file.stage = Stage::OpenSrc;
+            break;
+
+        case Stage::OpenSrc:
+            file.srcFd = res;
+            file.stage = Stage::OpenDst;
+            break;
+
+        case Stage::OpenDst:
+            file.dstFd = res;
+            file.buffer.resize(chunkSize);
+            file.stage = Stage::Read;
+            break;
+
+        case Stage::Read:
+            if (res == 0)
+            {
+                file.stage = Stage::Attributes;
+            }
+            else
+            {
+                file.length = res;
+                file.written = 0;
+                file.stage = Stage::Write;
+            }
+            break;
+
+        case Stage::Write:
+            file.written += res;
+            if (file.written == file.length)
+            {
+                file.offset += file.length;
+                file.stage = Stage::Read;
+            }
+            break;
+
+        case Stage::Attributes:
+            file.stage = Stage::Fsync;
+            break;
+
+        case Stage::Fsync:
+            file.buffer = {};
+            file.stage = Stage::Rename;
+            break;
+
+        case Stage::Rename:
+            touched.emplace(fs::path(file.dst).parent_path());
+            release(file, true);
+            return false;
+
+        case Stage::Entry:
+            touched.merge(file.touched);
+            for (const auto& child : file.children)
+            {
+                queue.emplace_back(file.path / child);
+            }
+            return false;
+
+        case Stage::SyncDirs:
+            return false;
+    }
+
+    if (!prepare(file))
+    {
+        release(file, false);
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+void UringEngine::release(File& file, bool success)
+{
+    if (file.srcFd != -1)
+    {
+        close(file.srcFd);
+        file.srcFd = -1;
+    }
+    if (file.dstFd != -1)
+    {
+        close(file.dstFd);
+        file.dstFd = -1;
+    }
+    if (!success && file.stage > Stage::OpenSrc && file.stage <= Stage::Rename)
+    {
+        unlink(file.tmp.c_str());
+    }
+}
+
+} // namespace fssync
@@ -0,0 +1,160 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2022, KNS Group LLC (YADRO).
+ */
+#pragma once
+
+#include "engine.hpp"
+
+#include <liburing.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace fssync
+{
+
+/**
+ * @brief Copy engine pipelining file I/O through io_uring.
+ *
+ * Every regular file passes through the statx, openat, read/write, fsync
+ * and renameat stages, each stage is a single request submitted to the ring.
+ * Up to `depth` files are processed simultaneously. Completions are reported
+ * through the eventfd registered with the ring.
+ *
+ * The stages io_uring can't do (creating parent directories, setting file
+ * attributes, transferring directories, symlinks and removed entries) are
+ * passed to a helper thread, which reports completion through the same
+ * eventfd. So the event loop never waits for the flash. When the batch is
+ * done, the helper thread flushes the modified destination directories.
+ */
+class UringEngine : public Engine
+{
+  public:
+    /**
+     * @brief ctor - setup io_uring, register eventfd and start helper thread
+     *
+     * @param event - sd-event object
+     * @param src   - source directory
+     * @param dst   - destination directory
+     * @param depth - max number of files processed simultaneously
+     *
+     * @throw std::runtime_error if the kernel doesn't support io_uring or
+     *        any of the required operations.
+     */
+    UringEngine(sdeventplus::Event& event, const fs::path& src,
+                const fs::path& dst, size_t depth);
+
+    /**
+     * @brief dtor - stop helper thread, release the ring and remove
+     * incomplete temporary files
+     */
+    ~UringEngine() override;
+
+    void cancel() override;
+
+  protected:
+    void submit(std::vector<fs::path>&& batch) override;
+    void complete() override;
+
+  private:
+    enum class Stage
+    {
+        Statx,
+        /** @brief Create parent directory, blocking */
+        Prepare,
+        OpenSrc,
+        OpenDst,
+        Read,
+        Write,
+        /** @brief Set owner, permissions and timestamps, blocking */
+        Attributes,
+        Fsync,
+        Rename,
+        /** @brief Transfer non-regular entry, blocking */
+        Entry,
+        /** @brief Flush the modified directories of the batch, blocking */
+        SyncDirs,
+    };
+
+    /**
+     * @brief Check whether the stage is done by the helper thread.
+     */
+    static bool isBlocking(Stage stage);
+
+    struct File
+    {
+        fs::path path;
+        std::string src;
+        std::string dst;
+        std::string tmp;
+        struct statx stx;
+        int srcFd = -1;
+        int dstFd = -1;
+        Stage stage = Stage::Statx;
+        off_t offset = 0;
+        size_t length = 0;
+        size_t written = 0;
+        std::vector<char> buffer;
+        /** @brief Entries of the transferred directory */
+        std::vector<fs::path> children;
+        /** @brief Destination directories modified by the stage */
+        std::set<fs::path> touched;
+    };
+
+    /**
+     * @brief Start processing of the queued files while there are free slots.
+     */
+    void fill();
+
+    /**
+     * @brief Move the file to the next stage according to the result of
+     * the current one.
+     *
+     * @return false if the file processing is done.
+     */
+    bool advance(File& file, int res);
+
+    /**
+     * @brief Queue the request for the current stage of the file.
+     */
+    bool prepare(File& file);
+
+    /**
+     * @brief Close descriptors of the file, on failure remove the temporary
+     * file.
+     */
+    void release(File& file, bool success);
+
+    /**
+     * @brief Handle the result of the stage, remove the finished file.
+     */
+    void handleResult(File* file, int res);
+
+    /**
+     * @brief Do the blocking stages of the files.
+     */
+    void worker();
+
+    struct io_uring ring;
+    size_t depth;
+    std::deque<fs::path> queue;
+    std::vector<std::unique_ptr<File>> active;
+    /** @brief Destination directories modified by the batch */
+    std::set<fs::path> touched;
+    bool failed = false;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    /** @brief Files waiting for the blocking stage */
+    std::deque<File*> blocking;
+    /** @brief Files with the blocking stage done and its result */
+    std::vector<std::pair<File*, int>> blockingDone;
+    bool stop = false;
+    std::thread thread;
+};
+
+} // namespace fssync
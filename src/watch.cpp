@@ -4,6 +4,8 @@
  */
 #include "watch.hpp"
 
+#include "logger.hpp"
+
 #include <fmt/format.h>
 #include <sys/inotify.h>
 #include <unistd.h>
@@ -25,8 +27,13 @@ Watch::Watch(sdeventplus::Event& event, int fd, const fs::path& root,
                           std::placeholders::_2, std::placeholders::_3)),
     rescan(event, std::bind(&Watch::rescanRoot, this, std::placeholders::_1)),
     post(event, std::bind(&Watch::checkWds, this, std::placeholders::_1)),
-    root(root), syncCallback(callback)
-{}
+    root(root), syncCallback(callback),
+    summary(event, {}, std::chrono::milliseconds{100},
+            std::bind(&Watch::logSummary, this, std::placeholders::_1,
+                      std::placeholders::_2))
+{
+    summary.set_enabled(sdeventplus::source::Enabled::Off);
+}
 
 Watch::~Watch()
 {
@@ -57,8 +64,7 @@ Watch Watch::create(sdeventplus::Event& event, const fs::path& root,
 static void rmWatch(int fd, int wd, const fs::path& path)
 {
     inotify_rm_watch(fd, wd);
-    log<level::DEBUG>(
-        fmt::format("Remove wd={}, '{}'", wd, path.c_str()).c_str());
+    logger::log<level::DEBUG>("Remove wd={}, '{}'", wd, path.c_str());
 }
 
 void Watch::handleEvent(sdeventplus::source::IO&, int fd, uint32_t)
@@ -73,10 +79,9 @@ void Watch::handleEvent(sdeventplus::source::IO&, int fd, uint32_t)
         auto evt =
             reinterpret_cast<struct inotify_event*>(buffer.data() + offset);
 
-        log<level::DEBUG>(fmt::format("INOTIFY: mask={:08X}, wd={}, name={}",
-                                      evt->mask, evt->wd,
-                                      evt->len > 0 ? evt->name : "(null)")
-                              .c_str());
+        logger::log<level::DEBUG>("INOTIFY: mask={:08X}, wd={}, name={}",
+                                  evt->mask, evt->wd,
+                                  evt->len > 0 ? evt->name : "(null)");
 
         offset += sizeof(*evt) + evt->len;
 
@@ -86,10 +91,12 @@ void Watch::handleEvent(sdeventplus::source::IO&, int fd, uint32_t)
             continue;
         }
 
+        auto path = evt->len > 0 ? it->second / evt->name : it->second;
+        countEvent(path);
+
         if (syncCallback)
         {
-            syncCallback(evt->mask,
-                         evt->len > 0 ? it->second / evt->name : it->second);
+            syncCallback(evt->mask, path);
         }
 
         // Add watch for the new directories
@@ -156,6 +163,41 @@ void Watch::checkWds(sdeventplus::source::EventBase& source)
     }
 }
 
+void Watch::countEvent(const fs::path& path)
+{
+    if (!logger::isEnabled(level::INFO))
+    {
+        return;
+    }
+
+    if (eventsCount++ == 0)
+    {
+        summary.set_time(Clock(summary.get_event()).now() +
+                         std::chrono::seconds{1});
+        summary.set_enabled(sdeventplus::source::Enabled::OneShot);
+    }
+    // Counting the hashes takes no allocation for the paths seen before.
+    eventPaths.insert(std::hash<std::string>{}(path.native()));
+}
+
+void Watch::logSummary(Time&, Time::TimePoint)
+{
+    if (eventsCount >= summaryThreshold)
+    {
+        logger::log<level::INFO>(
+            "INOTIFY: {} events for {} paths in the last second", eventsCount,
+            eventPaths.size());
+    }
+    else
+    {
+        logger::log<level::DEBUG>(
+            "INOTIFY: {} events for {} paths in the last second", eventsCount,
+            eventPaths.size());
+    }
+    eventsCount = 0;
+    eventPaths.clear();
+}
+
 static int createWatch(int fd, const fs::path& path)
 {
     constexpr auto flags = IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
@@ -166,7 +208,7 @@ static int createWatch(int fd, const fs::path& path)
         throw std::runtime_error(fmt::format("inotify_add_watch({}) failed, {}",
                                              path.c_str(), strerror(errno)));
     }
-    log<level::DEBUG>(fmt::format("Add wd={}, '{}'", wd, path.c_str()).c_str());
+    logger::log<level::DEBUG>("Add wd={}, '{}'", wd, path.c_str());
     return wd;
 }
 
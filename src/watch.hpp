@@ -4,12 +4,15 @@
  */
 #pragma once
 
+#include <sdeventplus/clock.hpp>
 #include <sdeventplus/event.hpp>
 #include <sdeventplus/source/event.hpp>
 #include <sdeventplus/source/io.hpp>
+#include <sdeventplus/source/time.hpp>
 
 #include <filesystem>
 #include <map>
+#include <unordered_set>
 
 namespace fs = std::filesystem;
 
@@ -23,6 +26,9 @@ class Watch
 {
   public:
     using Callback = std::function<void(int, const fs::path&)>;
+    static constexpr auto clockId = sdeventplus::ClockId::Monotonic;
+    using Clock = sdeventplus::Clock<clockId>;
+    using Time = sdeventplus::source::Time<clockId>;
 
     Watch() = delete;
     Watch(const Watch&) = delete;
@@ -83,6 +89,19 @@ class Watch
      */
     void checkWds(sdeventplus::source::EventBase& source);
 
+    /**
+     * @brief Account the event for the periodic summary.
+     */
+    void countEvent(const fs::path& path);
+
+    /**
+     * @brief Log number of events received in the last second.
+     *
+     * The summary goes to the journal at INFO level only when there are at
+     * least `summaryThreshold` events, otherwise it is a debug message.
+     */
+    void logSummary(Time& source, Time::TimePoint timePoint);
+
   private:
     sdeventplus::source::IO eventReader;
     sdeventplus::source::Defer rescan;
@@ -90,6 +109,14 @@ class Watch
     std::map<int, fs::path> wds;
     fs::path root;
     Callback syncCallback;
+
+    /** @brief Number of events per second worth reporting */
+    static constexpr size_t summaryThreshold = 100;
+
+    Time summary;
+    size_t eventsCount = 0;
+    /** @brief Hashes of the event paths */
+    std::unordered_set<size_t> eventPaths;
 };
 
 } // namespace inotify
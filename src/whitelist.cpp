@@ -43,4 +43,9 @@ bool WhiteList::check(const fs::path& entryPath) const
     return false;
 }
 
+std::vector<fs::path> WhiteList::entries() const
+{
+    return {items.begin(), items.end()};
+}
+
 } // namespace fssync
@@ -6,6 +6,7 @@
 
 #include <filesystem>
 #include <set>
+#include <vector>
 
 namespace fs = std::filesystem;
 
@@ -55,6 +56,11 @@ class WhiteList
      */
     bool check(const fs::path& entryPath) const;
 
+    /**
+     * @brief Get the loaded filter entries.
+     */
+    std::vector<fs::path> entries() const;
+
   private:
     std::set<fs::path, details::PathsComparer> items;
 };